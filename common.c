@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -5,7 +6,10 @@
 #include <string.h>
 #include <time.h>
 
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #define SYSLOG_NAMES
 #include <syslog.h>
 
@@ -37,13 +41,154 @@ void myloglevel(int level)
 		setlogmask(LOG_UPTO(maxloglevel));
 }
 
+/* asynchronous logging
+ * mylog() formats into the next free slot of a ring,
+ * a thread writes the slots out.
+ * There is 1 writer (the main thread) and 1 reader (the log thread),
+ * so head & tail need no locks.
+ */
+#define LOGSLOTSIZE	256
+struct logslot {
+	int loglevel;
+	int len;
+	char msg[LOGSLOTSIZE];
+};
+
+static struct logslot *logring;
+static unsigned int nlogslots; /* power of 2 */
+/* head: next slot to write, tail: next slot to output */
+static unsigned int loghead, logtail;
+static unsigned int logdropped;
+/* logseq moves with each new message or stop request, the log thread sleeps on it */
+static unsigned int logseq;
+static int logwaiting, logstop;
+static pthread_t logthread;
+
+static void logfutex(unsigned int *addr, int op, unsigned int val)
+{
+	syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void logout(int loglevel, const char *msg, int len)
+{
+	if (logtostderr) {
+		if (label)
+			fprintf(stderr, "%s: ", label);
+		fwrite(msg, len, 1, stderr);
+		fputc('\n', stderr);
+	} else
+		syslog(loglevel, "%s", msg);
+}
+
+static void *logthreadfn(void *dat)
+{
+	unsigned int seq, head, tail, dropped, lastdropped = 0;
+	struct logslot *slot;
+	char buf[64];
+
+	for (;;) {
+		seq = __atomic_load_n(&logseq, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&loghead, __ATOMIC_ACQUIRE);
+		for (tail = logtail; tail != head; ++tail) {
+			slot = &logring[tail & (nlogslots-1)];
+			logout(slot->loglevel, slot->msg, slot->len);
+			/* release the slot */
+			__atomic_store_n(&logtail, tail+1, __ATOMIC_RELEASE);
+		}
+		dropped = __atomic_load_n(&logdropped, __ATOMIC_RELAXED);
+		if (dropped != lastdropped) {
+			logout(LOG_WARNING, buf, sprintf(buf, "%u log messages dropped", dropped - lastdropped));
+			lastdropped = dropped;
+		}
+		if (logtostderr)
+			fflush(stderr);
+		if (__atomic_load_n(&logstop, __ATOMIC_ACQUIRE) &&
+				head == __atomic_load_n(&loghead, __ATOMIC_ACQUIRE))
+			break;
+		/* sleep until mylog() moves logseq */
+		__atomic_store_n(&logwaiting, 1, __ATOMIC_SEQ_CST);
+		if (seq == __atomic_load_n(&logseq, __ATOMIC_SEQ_CST))
+			logfutex(&logseq, FUTEX_WAIT_PRIVATE, seq);
+		__atomic_store_n(&logwaiting, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void logwake(void)
+{
+	__atomic_store_n(&logseq, logseq+1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logwaiting, __ATOMIC_SEQ_CST))
+		logfutex(&logseq, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/* drain the ring and stop the thread */
+static void mysynclog(void)
+{
+	if (!logring)
+		return;
+	__atomic_store_n(&logstop, 1, __ATOMIC_SEQ_CST);
+	logwake();
+	pthread_join(logthread, NULL);
+	free(logring);
+	logring = NULL;
+}
+
+int myasynclog(int nslots)
+{
+	int ret;
+
+	if (logring)
+		return 0;
+	if (logtostderr < 0)
+		myopenlog(NULL, 0, LOG_LOCAL1);
+	for (nlogslots = 1; nlogslots < nslots; nlogslots <<= 1);
+	logring = malloc(nlogslots*sizeof(*logring));
+	if (!logring)
+		return -1;
+	loghead = logtail = logdropped = logseq = logstop = 0;
+	ret = pthread_create(&logthread, NULL, logthreadfn, NULL);
+	if (ret) {
+		free(logring);
+		logring = NULL;
+		errno = ret;
+		return -1;
+	}
+	atexit(mysynclog);
+	return 0;
+}
+
 void mylog(int loglevel, const char *fmt, ...)
 {
 	va_list va;
+	struct logslot *slot;
+	int len;
 
 	if (logtostderr < 0)
 		myopenlog(NULL, 0, LOG_LOCAL1);
 
+	if (logring && loglevel <= LOG_ERR)
+		/* we're about to exit, don't lose this one */
+		mysynclog();
+	if (logring) {
+		if (loglevel > maxloglevel)
+			goto done;
+		if (loghead - __atomic_load_n(&logtail, __ATOMIC_ACQUIRE) >= nlogslots) {
+			/* ring full */
+			__atomic_add_fetch(&logdropped, 1, __ATOMIC_RELAXED);
+			goto done;
+		}
+		slot = &logring[loghead & (nlogslots-1)];
+		va_start(va, fmt);
+		len = vsnprintf(slot->msg, sizeof(slot->msg), fmt, va);
+		va_end(va);
+		slot->loglevel = loglevel;
+		/* truncate */
+		slot->len = (len < sizeof(slot->msg)) ? len : sizeof(slot->msg)-1;
+		__atomic_store_n(&loghead, loghead+1, __ATOMIC_RELEASE);
+		logwake();
+		goto done;
+	}
+
 	if (logtostderr && loglevel > maxloglevel)
 		goto done;
 	va_start(va, fmt);
@@ -74,6 +219,52 @@ int mysetloglevelstr(char *str)
 	return -1;
 }
 
+/* exact powers of 10 */
+static const double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+	1e21, 1e22,
+};
+
+/* plain decimal numbers: [+-]digits[.digits]
+ * With at most 15 digits, the digits are an exact integer,
+ * and 1 division by an exact power of 10 rounds correctly.
+ * return 0 when <str> needs the full strtod()
+ */
+static int fast_strtod(const char *str, double *pvalue, char **endp)
+{
+	const char *s = str;
+	unsigned long long mant = 0;
+	int nsig = 0, nfrac = -1, neg = 0, any = 0;
+
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+	for (;; ++s) {
+		if (*s == '.' && nfrac < 0) {
+			nfrac = 0;
+			continue;
+		}
+		if (*s < '0' || *s > '9')
+			break;
+		any = 1;
+		mant = mant*10 + *s - '0';
+		/* count significant digits, from the first non-zero one */
+		nsig += !!mant;
+		nfrac += nfrac >= 0;
+	}
+	if (*s || !any)
+		/* more than a plain number, or no number at all */
+		return 0;
+	if (nsig > 15 || nfrac >= (int)(sizeof(pow10tab)/sizeof(pow10tab[0])))
+		return 0;
+	*pvalue = (nfrac > 0) ? mant / pow10tab[nfrac] : mant;
+	if (neg && mant)
+		/* like mystrtod, "-0" yields 0 */
+		*pvalue = -*pvalue;
+	*endp = (char *)s;
+	return 1;
+}
+
 double mystrtod(const char *str, char **endp)
 {
 	char *localendp;
@@ -85,6 +276,8 @@ double mystrtod(const char *str, char **endp)
 		endp = &localendp;
 	if (!str)
 		return NAN;
+	if (fast_strtod(str, &value, endp))
+		return value;
 
 	for (value = 0, fact2 = 1, strpos = str; *strpos;) {
 		part = strtod(strpos, endp);
@@ -124,13 +317,85 @@ double mystrtod(const char *str, char **endp)
 done:
 	return (*endp == str) ? NAN : value;
 }
-const char *mydtostr(double d)
+
+/* produce what "%lg" produces, for 1e-4 <= |d| < 1e6
+ * These print as %f with 6 significant digits.
+ * return 0 when <d> needs the full sprintf()
+ */
+static int fast_dtostr(double d, char *buf)
+{
+	static const double lowtab[] = { 1e-4, 1e-3, 1e-2, 1e-1, };
+	char digits[8], *str = buf;
+	double a, scaled, frac;
+	long mant, ipart;
+	int exp, prec, j, len;
+
+	a = fabs(d);
+	if (!(a >= 1e-4 && a < 1e6))
+		/* out of range, or nan */
+		return 0;
+	if (a == (long)a) {
+		/* integers print as such */
+		ipart = a;
+		prec = 0;
+		mant = 0;
+		goto print;
+	}
+	/* decimal exponent */
+	if (a >= 1)
+		for (exp = 0; a >= pow10tab[exp+1]; ++exp);
+	else
+		for (exp = -1; a < lowtab[4+exp]; --exp);
+	/* scale to 6 significant digits */
+	prec = 5-exp;
+	scaled = a * pow10tab[prec];
+	mant = scaled;
+	frac = scaled - mant;
+	if (frac > 0.5-1e-6 && frac < 0.5+1e-6)
+		/* a tie, for all we know: let sprintf round the exact value */
+		return 0;
+	if (frac > 0.5)
+		++mant;
+	if (mant >= 1000000) {
+		/* rounded up to the next decade */
+		if (!prec)
+			return 0;
+		mant /= 10;
+		--prec;
+	}
+	ipart = mant / (long)pow10tab[prec];
+	mant %= (long)pow10tab[prec];
+	/* strip trailing zeroes */
+	for (; prec && !(mant % 10); --prec)
+		mant /= 10;
+print:
+	if (d < 0)
+		*str++ = '-';
+	len = 0;
+	do {
+		digits[len++] = '0' + ipart % 10;
+		ipart /= 10;
+	} while (ipart);
+	while (len)
+		*str++ = digits[--len];
+	if (prec) {
+		*str++ = '.';
+		for (j = prec; j--; mant /= 10)
+			str[j] = '0' + mant % 10;
+		str += prec;
+	}
+	*str = 0;
+	return 1;
+}
+
+char *mydtostr_r(double d, char *buf, int size)
 {
-	static char buf[64];
 	char *str;
 	int ptpresent = 0;
 
-	sprintf(buf, "%lg", d);
+	if (size >= 16 && fast_dtostr(d, buf))
+		return buf;
+	snprintf(buf, size, "%lg", d);
 	for (str = buf; *str; ++str) {
 		if (*str == '.')
 			ptpresent = 1;
@@ -152,6 +417,13 @@ const char *mydtostr(double d)
 	return buf;
 }
 
+const char *mydtostr(double d)
+{
+	static char buf[64];
+
+	return mydtostr_r(d, buf, sizeof(buf));
+}
+
 char *resolve_relative_path(const char *path, const char *ref)
 {
 	char *abspath, *str, *up;
@@ -11,8 +11,15 @@ extern void mylog(int loglevel, const char *fmt, ...);
 extern void myopenlog(const char *name, int options, int facility);
 extern void myloglevel(int loglevel);
 extern int mysetloglevelstr(char *str);
+/* log from a background thread, via a ring of <nslots> messages
+ * mylog() then only formats into the ring, and never blocks.
+ * Messages that find the ring full are dropped, and counted.
+ */
+extern int myasynclog(int nslots);
 
 extern const char *mydtostr(double d);
+/* mydtostr into <buf>, which should hold 16 bytes or more */
+extern char *mydtostr_r(double d, char *buf, int size);
 extern double mystrtod(const char *str, char **endp);
 
 /* return absolute path of <path> reletive from <ref> */
@@ -0,0 +1,187 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+/* the plain sprintf/strtod versions of mydtostr & mystrtod,
+ * as reference
+ */
+static const char *ref_dtostr(double d)
+{
+	static char buf[64];
+	char *str;
+	int ptpresent = 0;
+
+	sprintf(buf, "%lg", d);
+	for (str = buf; *str; ++str) {
+		if (*str == '.')
+			ptpresent = 1;
+		else if (*str == 'e')
+			break;
+		else if (ptpresent && *str == '0') {
+			int len = strspn(str, "0");
+			if (!str[len]) {
+				*str = 0;
+				if (str > buf && *(str-1) == '.')
+					*(str-1) = 0;
+				break;
+			}
+		}
+	}
+	return buf;
+}
+
+static double ref_strtod(const char *str)
+{
+	char *endp = NULL;
+	const char *strpos;
+	double value, part;
+	unsigned long fact, fact2;
+
+	for (value = 0, fact2 = 1, strpos = str; *strpos;) {
+		part = strtod(strpos, &endp);
+		if (endp <= strpos)
+			goto done;
+		switch (*endp) {
+		case 'w':
+			fact = 60*60*24*7;
+			fact2 = 60*60*24;
+			break;
+		case 'd':
+			fact = 60*60*24;
+			fact2 = 60*60;
+			break;
+		case 'h':
+			fact = 60*60;
+			fact2 = 60;
+			break;
+		case 'm':
+			fact = 60;
+			fact2 = 1;
+			break;
+		case 's':
+			fact = 1;
+			fact2 = 0;
+			break;
+		case 0:
+			value += part*fact2;
+			goto done;
+		default:
+			goto done;
+		}
+		value += part*fact;
+		strpos = endp+1;
+	}
+done:
+	return (endp == str) ? NAN : value;
+}
+
+/* values as they occur: sensor readings, counters, timestamps */
+static double testvalue(int j)
+{
+	switch (j % 6) {
+	case 0:
+		return rand() % 2000 - 1000;
+	case 1:
+		return (rand() % 200000 - 100000) / 1000.0;
+	case 2:
+		return (rand() % 1000) * 1e-3 * 0.1;
+	case 3:
+		return drand48() * pow(10, rand() % 20 - 10);
+	case 4:
+		return -drand48() * 1e6;
+	default:
+		return 1.6e9 + drand48() * 1e8;
+	}
+}
+
+static double timeit(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec)*1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	int j, n, nerr = 0;
+	double *values, sum;
+	char (*strs)[32];
+	struct timespec t0;
+	double tref, tnew;
+	static const double edges[] = {
+		0, -0.0, 1, -1, 0.1, 0.5, 1e-4, 9.99999e-5, 0.000123456789,
+		999999, 999999.5, 999999.4, 9.999996, 99.99995, 0.30000000000000004,
+		123456.5, 1e6, 1e100, -1e-300, NAN, INFINITY, -INFINITY,
+	};
+	static const char *const strtests[] = {
+		"0", "-0", "+5", "1.", ".5", "0.1", "-12.375", "1e3", "0x10",
+		"999999999999999", "1234567890123456789", "0.0000000000000000000001",
+		"5m", "1h30", "1d2h", ".", "-", " 1", "1 ",
+	};
+
+	n = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+	values = malloc(n*sizeof(*values));
+	strs = malloc(n*sizeof(*strs));
+	if (!values || !strs)
+		return 1;
+
+	/* correctness */
+	for (j = 0; j < sizeof(edges)/sizeof(edges[0]); ++j) {
+		if (strcmp(mydtostr(edges[j]), ref_dtostr(edges[j]))) {
+			printf("dtostr %.17g: '%s' != '%s'\n", edges[j], mydtostr(edges[j]), ref_dtostr(edges[j]));
+			++nerr;
+		}
+	}
+	for (j = 0; j < sizeof(strtests)/sizeof(strtests[0]); ++j) {
+		if (memcmp(&(double){ mystrtod(strtests[j], NULL) }, &(double){ ref_strtod(strtests[j]) }, sizeof(double)) &&
+				!(isnan(mystrtod(strtests[j], NULL)) && isnan(ref_strtod(strtests[j])))) {
+			printf("strtod '%s': %.17g != %.17g\n", strtests[j], mystrtod(strtests[j], NULL), ref_strtod(strtests[j]));
+			++nerr;
+		}
+	}
+	for (j = 0; j < n; ++j) {
+		values[j] = testvalue(j);
+		strcpy(strs[j], ref_dtostr(values[j]));
+		if (strcmp(mydtostr(values[j]), strs[j])) {
+			if (nerr++ < 10)
+				printf("dtostr %.17g: '%s' != '%s'\n", values[j], mydtostr(values[j]), strs[j]);
+		}
+		if (memcmp(&(double){ mystrtod(strs[j], NULL) }, &(double){ ref_strtod(strs[j]) }, sizeof(double))) {
+			if (nerr++ < 10)
+				printf("strtod '%s': %.17g != %.17g\n", strs[j], mystrtod(strs[j], NULL), ref_strtod(strs[j]));
+		}
+	}
+	printf("%i values, %i errors\n", n, nerr);
+
+	/* speed */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j = 0, sum = 0; j < n; ++j)
+		sum += *ref_dtostr(values[j]);
+	tref = timeit(&t0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j = 0; j < n; ++j)
+		sum += *mydtostr(values[j]);
+	tnew = timeit(&t0);
+	printf("dtostr: %.1lf ns -> %.1lf ns\n", tref*1e9/n, tnew*1e9/n);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j = 0; j < n; ++j)
+		sum += ref_strtod(strs[j]);
+	tref = timeit(&t0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (j = 0; j < n; ++j)
+		sum += mystrtod(strs[j], NULL);
+	tnew = timeit(&t0);
+	printf("strtod: %.1lf ns -> %.1lf ns\n", tref*1e9/n, tnew*1e9/n);
+	/* keep the loops */
+	if (sum == 0.5)
+		printf("\n");
+	free(values);
+	free(strs);
+	return !!nerr;
+}
@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+#include "lib/libe.h"
+#include "lib/libt.h"
+#include "common.h"
+#include "evloop.h"
+
+static struct mosquitto *mosq;
+static int mosqfd = -1;
+static int timerfd = -1;
+static int mosqkeepalive;
+static struct libt_timer *misctimer;
+
+/* shared virtual clock */
+static struct {
+	int on;
+	char *round; /* round of the clock to report, NULL when reported */
+	int busy; /* handled events since the last report */
+} vclock;
+
+static void evloop_mosq_misc(void *dat)
+{
+	int ret;
+
+	/* keepalive */
+	ret = mosquitto_loop_misc(mosq);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_loop_misc: %s", mosquitto_strerror(ret));
+}
+
+static void evloop_mosq_ready(int fd, void *dat)
+{
+	int ret;
+
+	if (libe_events() & LIBE_RD) {
+		ret = mosquitto_loop_read(mosq, 1);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_loop_read: %s", mosquitto_strerror(ret));
+	}
+	if (libe_events() & LIBE_WR) {
+		ret = mosquitto_loop_write(mosq, 1);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
+	}
+}
+
+void evloop_virtual_clock(void)
+{
+	vclock.on = 1;
+	libt_virtual_clock(libt_now());
+}
+
+int evloop_clock_msg(const struct mosquitto_message *msg)
+{
+	static const int len = sizeof(EVLOOP_CLOCK_TOPIC)-1;
+	char *str;
+	double now;
+
+	if (strncmp(msg->topic, EVLOOP_CLOCK_TOPIC, len) ||
+			(msg->topic[len] && msg->topic[len] != '/')) {
+		/* anything else keeps us busy */
+		vclock.busy = 1;
+		return 0;
+	}
+	if (!vclock.on || msg->topic[len] || !msg->payloadlen)
+		/* the reports, or no virtual clock */
+		return 1;
+	/* "<round> <time>" */
+	str = strchr(msg->payload, ' ');
+	if (!str)
+		return 1;
+	now = strtod(str+1, NULL);
+	libt_set_now(now);
+	if (vclock.round)
+		free(vclock.round);
+	vclock.round = strndup(msg->payload, str - (char *)msg->payload);
+	return 1;
+}
+
+static void evloop_clock_report(void)
+{
+	int ret;
+	char buf[128];
+
+	/* "<round> <busy> <next timeout>", round '-' reports work outside a round.
+	 * %.17g is exact, so the timeout is due when the clock moves there
+	 */
+	snprintf(buf, sizeof(buf), "%s %i %.17g", vclock.round ?: "-", vclock.busy, libt_next_wakeup());
+	ret = mosquitto_publish(mosq, NULL, EVLOOP_CLOCK_TOPIC "/idle", strlen(buf), buf, 1, 0);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s/idle: %s", EVLOOP_CLOCK_TOPIC, mosquitto_strerror(ret));
+	if (vclock.round)
+		free(vclock.round);
+	vclock.round = NULL;
+	vclock.busy = 0;
+}
+
+void evloop_init(struct mosquitto *m, int keepalive)
+{
+	int ret;
+
+	if (!vclock.on) {
+		/* timers as events */
+		timerfd = libt_timerfd();
+		if (timerfd >= 0)
+			libe_add_fd(timerfd, libt_flush_timerfd, NULL);
+	}
+	mosq = m;
+	if (!mosq) {
+		if (vclock.on)
+			mylog(LOG_ERR, "a virtual clock needs MQTT");
+		return;
+	}
+	mosqfd = mosquitto_socket(mosq);
+	if (libe_add_fd(mosqfd, evloop_mosq_ready, NULL) < 0)
+		mylog(LOG_ERR, "watch mosquitto socket: %s", ESTR(errno));
+	mosqkeepalive = keepalive;
+	if (vclock.on) {
+		ret = mosquitto_subscribe(mosq, NULL, EVLOOP_CLOCK_TOPIC, 1);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_subscribe '%s': %s", EVLOOP_CLOCK_TOPIC, mosquitto_strerror(ret));
+	} else {
+		/* a PINGREQ is due after <keepalive> seconds without traffic,
+		 * the broker gives up after 1.5 times <keepalive>
+		 */
+		misctimer = libt_timer_new(evloop_mosq_misc, NULL);
+		libt_timer_slack(misctimer, keepalive/8.0);
+		libt_timer_periodic(misctimer, keepalive/4.0);
+	}
+}
+
+int evloop_iterate(int maxwait)
+{
+	int ret, waittime;
+
+	if (timerfd < 0 && libt_flush() && vclock.on)
+		vclock.busy = 1;
+	if (mosq)
+		/* write when the socket is writable */
+		libe_mod_fd(mosqfd, LIBE_RD | (mosquitto_want_write(mosq) ? LIBE_WR : 0));
+
+	waittime = (timerfd < 0) ? libt_get_waittime() : -1;
+	if (vclock.on)
+		/* the timers wait for the shared clock.
+		 * Poll when a report is due, else wake for the keepalive only
+		 */
+		waittime = (vclock.round || vclock.busy) ? 0 : mosqkeepalive*1000/4;
+	if (maxwait >= 0 && (waittime < 0 || waittime > maxwait))
+		waittime = maxwait;
+
+	ret = libe_wait(waittime);
+	if (ret < 0 && errno != EINTR)
+		mylog(LOG_ERR, "libe_wait: %s", ESTR(errno));
+	libe_flush();
+	if (vclock.on) {
+		evloop_mosq_misc(NULL);
+		if (!ret && (vclock.round || vclock.busy) &&
+				!(libt_next_wakeup() >= 0 && libt_next_wakeup() <= libt_now()))
+			/* nothing left to do, until the clock moves */
+			evloop_clock_report();
+	}
+	return ret;
+}
@@ -0,0 +1,44 @@
+#ifndef _evloop_h_
+#define _evloop_h_
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* event loop for the tools:
+ * libe waits for the mosquitto socket, the fds that the
+ * program added with libe_add_fd(), and libt's timers.
+ */
+struct mosquitto;
+
+/* run libt on a virtual clock, shared by all programs of a simulation.
+ * mqttvclock publishes the time on EVLOOP_CLOCK_TOPIC in rounds.
+ * Each program reports on EVLOOP_CLOCK_TOPIC/idle once it has nothing
+ * left to do, and mqttvclock moves the time to the earliest timeout
+ * only when all programs reported idle without having done any work.
+ * Call this before evloop_init()
+ */
+#define EVLOOP_CLOCK_TOPIC	"tmp/virtualclock"
+extern void evloop_virtual_clock(void);
+
+/* call this first in the MQTT message callback.
+ * Returns 1 when <msg> belongs to the virtual clock, and the
+ * program must ignore it.
+ */
+struct mosquitto_message;
+extern int evloop_clock_msg(const struct mosquitto_message *msg);
+
+/* prepare the event loop, with the socket of <mosq> when not NULL
+ * <keepalive> is the MQTT keepalive, in seconds
+ */
+extern void evloop_init(struct mosquitto *mosq, int keepalive);
+
+/* wait for events up to <maxwait> msecs (-1 waits until any event),
+ * and handle them.
+ * Returns the result of libe_wait(), so a signal returns -1
+ */
+extern int evloop_iterate(int maxwait);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -16,74 +16,401 @@
  * You should have received a copy of the GNU Lesser Public License
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && !defined(NO_IO_URING)
+#define USE_IO_URING
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "libe.h"
 
 struct event {
-	struct event *next, *prev;
+	struct event *next; /* garbage list */
 	void (*fn)(int fd, void *dat);
 	void *dat;
+	int fd; /* -1 when removed */
+	int mask;
+};
+
+/* asynchronous read */
+struct ioreq {
+	struct ioreq *next;
+	void (*fn)(int fd, void *dat);
+	void *dat;
+	void *buf;
+	int len;
 	int fd;
+	off_t offset;
+#ifdef USE_IO_URING
+	struct iovec iov; /* for IORING_OP_READV */
+	int viaring; /* -EINVAL from io_uring, retried with pread */
+#endif
 };
 
 static struct {
-	struct event *events;
+	/* events, indexed by fd */
+	struct event **fds;
+	int sfds;
+	int nevents;
+	/* removed events, freed when no batch refers to them */
+	struct event *garbage;
 	int epfd; /* epoll file descriptor */
-	int nevs;
+	/* ready batch */
+	struct epoll_event *evs;
+	int nevs, sevs;
+	int full; /* the last batch was full */
 	#define NEVS	16
-	struct epoll_event evs[NEVS];
+	int revents; /* events of the current handler */
+	/* reads */
+	struct ioreq *freereqs;
+	struct ioreq *ioreqs, **lastioreq; /* without io_uring */
+	int ioresult; /* result of the current read handler */
+#ifdef USE_IO_URING
+	int ringfd; /* -1: no io_uring, 0: not yet tried */
+	void *sqmap, *cqmap;
+	size_t sqmapsize, cqmapsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	int tosubmit;
+	/* queued reads without completion, the cq must hold them all */
+	int inflight;
+	int cqentries;
+	int readop; /* IORING_OP_READ(V) */
+	int noring; /* reads via io_uring fail, use pread */
+	#define RING_ENTRIES	64
+#endif
 } s = {
 	.epfd = -1,
+	.lastioreq = &s.ioreqs,
 };
 
-/* double-linked-list black magic:
- * The @prev member of the first element points to a 'fake' element
- * which is well-crafted so that assigning prev->next just happens
- * to set the root pointer
- * This function return the required 'fake' pointers
+static int e_epoll_events(int mask)
+{
+	return ((mask & LIBE_RD) ? EPOLLIN : 0) |
+		((mask & LIBE_WR) ? EPOLLOUT : 0) |
+		((mask & LIBE_ET) ? EPOLLET : 0);
+}
+
+static int e_ctl(int op, struct event *t)
+{
+	struct epoll_event evdat = {
+		.events = e_epoll_events(t->mask),
+		.data.ptr = t,
+	};
+
+	if (s.epfd < 0)
+		/* registered when epoll starts */
+		return 0;
+	return epoll_ctl(s.epfd, op, t->fd, &evdat);
+}
+
+static void e_collect_garbage(void)
+{
+	struct event *t;
+
+	while (s.garbage) {
+		t = s.garbage;
+		s.garbage = t->next;
+		free(t);
+	}
+}
+
+/* reads */
+static struct ioreq *e_alloc_ioreq(void)
+{
+	struct ioreq *req;
+
+	req = s.freereqs;
+	if (req)
+		s.freereqs = req->next;
+	else
+		req = malloc(sizeof(*req));
+	/* see malloc in libe_add_fd_mask */
+	memset(req, 0, sizeof(*req));
+	return req;
+}
+
+static void e_complete(struct ioreq *req, int result)
+{
+	s.ioresult = result;
+	req->fn(req->fd, req->dat);
+	s.ioresult = 0;
+	req->next = s.freereqs;
+	s.freereqs = req;
+}
+
+#ifdef USE_IO_URING
+/* io_uring, with raw syscalls */
+static int e_uring_enter(int tosubmit)
+{
+	return syscall(__NR_io_uring_enter, s.ringfd, tosubmit, 0, 0, NULL, 0);
+}
+
+/* the kernel stops submitting at a failing sqe,
+ * the rest remains for the next call
  */
-static inline struct event *t_fakeelement(struct event **root)
+static int e_uring_submit(void)
 {
-	return (struct event *)(((char *)root) - offsetof(struct event, next));
+	int ret;
+
+	ret = e_uring_enter(s.tosubmit);
+	if (ret > 0)
+		s.tosubmit -= ret;
+	return ret;
+}
+
+static void e_uring_ready(int fd, void *dat)
+{
+	struct io_uring_cqe *cqe;
+	struct ioreq *req;
+	unsigned head;
+
+	head = *s.cqhead;
+	while (head != __atomic_load_n(s.cqtail, __ATOMIC_ACQUIRE)) {
+		cqe = &s.cqes[head & *s.cqmask];
+		++head;
+		req = (struct ioreq *)(uintptr_t)cqe->user_data;
+		/* release the cqe before the handler submits more */
+		__atomic_store_n(s.cqhead, head, __ATOMIC_RELEASE);
+		--s.inflight;
+		if (cqe->res == -EINVAL) {
+			/* maybe the kernel lacks the opcode, retry with pread */
+			req->viaring = 1;
+			req->next = NULL;
+			*s.lastioreq = req;
+			s.lastioreq = &req->next;
+			continue;
+		}
+		e_complete(req, cqe->res);
+	}
+}
 
+static void e_uring_exit(void)
+{
+	if (s.sqes)
+		munmap(s.sqes, s.sqessize);
+	if (s.cqmap && s.cqmap != s.sqmap)
+		munmap(s.cqmap, s.cqmapsize);
+	if (s.sqmap)
+		munmap(s.sqmap, s.sqmapsize);
+	if (s.ringfd > 0)
+		close(s.ringfd);
+	s.sqes = NULL;
+	s.sqmap = s.cqmap = NULL;
+	s.ringfd = -1;
 }
 
-/* double linked list */
-static void t_del(struct event *t)
+/* IORING_OP_READ needs linux 5.6, IORING_OP_READV exists since 5.1 */
+static int e_uring_readop(void)
 {
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = t->prev = NULL;
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_register)
+	struct io_uring_probe *probe;
+	int ret, op = IORING_OP_READV;
+
+	/* IORING_REGISTER_PROBE is 5.6 too, failure means READV */
+	probe = calloc(1, sizeof(*probe) + 256*sizeof(probe->ops[0]));
+	if (!probe)
+		return op;
+	ret = syscall(__NR_io_uring_register, s.ringfd, IORING_REGISTER_PROBE, probe, 256);
+	if (ret >= 0 && probe->ops_len > IORING_OP_READ &&
+			(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+		op = IORING_OP_READ;
+	free(probe);
+	return op;
+#else
+	return IORING_OP_READV;
+#endif
 }
 
-static void t_add(struct event *t, struct event **root)
+static int e_uring_init(void)
 {
-	t_del(t);
-	t->next = *root;
-	if (t->next) {
-		t->prev = t->next->prev;
-		t->next->prev = t;
-	} else
-		/* this is dirty: fake a event struct, which will only be used
-		 * for setting the @next member
-		 */
-		t->prev = t_fakeelement(root);
-	t->prev->next = t;
+	struct io_uring_params p = {};
+
+	s.ringfd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (s.ringfd < 0) {
+		s.ringfd = -1;
+		return -1;
+	}
+	s.sqmapsize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	s.cqmapsize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (s.cqmapsize > s.sqmapsize)
+			s.sqmapsize = s.cqmapsize;
+		s.cqmapsize = s.sqmapsize;
+	}
+	s.sqmap = mmap(NULL, s.sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, s.ringfd, IORING_OFF_SQ_RING);
+	if (s.sqmap == MAP_FAILED) {
+		s.sqmap = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		s.cqmap = s.sqmap;
+	else {
+		s.cqmap = mmap(NULL, s.cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, s.ringfd, IORING_OFF_CQ_RING);
+		if (s.cqmap == MAP_FAILED) {
+			s.cqmap = NULL;
+			goto fail;
+		}
+	}
+	s.sqessize = p.sq_entries*sizeof(struct io_uring_sqe);
+	s.sqes = mmap(NULL, s.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, s.ringfd, IORING_OFF_SQES);
+	if (s.sqes == MAP_FAILED) {
+		s.sqes = NULL;
+		goto fail;
+	}
+	s.sqhead = s.sqmap + p.sq_off.head;
+	s.sqtail = s.sqmap + p.sq_off.tail;
+	s.sqmask = s.sqmap + p.sq_off.ring_mask;
+	s.sqarray = s.sqmap + p.sq_off.array;
+	s.cqhead = s.cqmap + p.cq_off.head;
+	s.cqtail = s.cqmap + p.cq_off.tail;
+	s.cqmask = s.cqmap + p.cq_off.ring_mask;
+	s.cqes = s.cqmap + p.cq_off.cqes;
+	s.cqentries = p.cq_entries;
+	s.readop = e_uring_readop();
+	/* completions wake up epoll */
+	if (libe_add_fd(s.ringfd, e_uring_ready, NULL) < 0)
+		goto fail;
+	return 0;
+fail:
+	e_uring_exit();
+	return -1;
+}
+
+static int e_uring_pread(struct ioreq *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	if (!s.ringfd && e_uring_init() < 0)
+		return -1;
+	if (s.ringfd < 0 || s.noring)
+		return -1;
+	if (s.inflight >= s.cqentries)
+		/* the cq would overflow, use pread */
+		return -1;
+	tail = *s.sqtail;
+	if (tail - __atomic_load_n(s.sqhead, __ATOMIC_ACQUIRE) > *s.sqmask) {
+		/* full, submit what we have */
+		if (e_uring_submit() < 0)
+			return -1;
+		if (tail - __atomic_load_n(s.sqhead, __ATOMIC_ACQUIRE) > *s.sqmask)
+			/* still full, use pread */
+			return -1;
+	}
+	idx = tail & *s.sqmask;
+	sqe = &s.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = s.readop;
+	sqe->fd = req->fd;
+	if (s.readop == IORING_OP_READV) {
+		req->iov.iov_base = req->buf;
+		req->iov.iov_len = req->len;
+		sqe->addr = (uintptr_t)&req->iov;
+		sqe->len = 1;
+	} else {
+		sqe->addr = (uintptr_t)req->buf;
+		sqe->len = req->len;
+	}
+	sqe->off = req->offset;
+	sqe->user_data = (uintptr_t)req;
+	s.sqarray[idx] = idx;
+	__atomic_store_n(s.sqtail, tail+1, __ATOMIC_RELEASE);
+	++s.tosubmit;
+	++s.inflight;
+	return 0;
+}
+#endif
+
+int libe_pread(int fd, void *buf, int len, off_t offset, void (*fn)(int fd, void *), const void *dat)
+{
+	struct ioreq *req;
+
+	req = e_alloc_ioreq();
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+	req->fn = fn;
+	req->dat = (void *)dat;
+#ifdef USE_IO_URING
+	if (e_uring_pread(req) >= 0)
+		return 0;
+#endif
+	/* queue, read in libe_flush */
+	*s.lastioreq = req;
+	s.lastioreq = &req->next;
+	return 0;
+}
+
+int libe_result(void)
+{
+	return s.ioresult;
+}
+
+static void e_flush_ioreqs(void)
+{
+	struct ioreq *req, *next;
+	int ret;
+
+	/* reads queued by the handlers go to the next round */
+	req = s.ioreqs;
+	s.ioreqs = NULL;
+	s.lastioreq = &s.ioreqs;
+	for (; req; req = next) {
+		next = req->next;
+		ret = pread(req->fd, req->buf, req->len, req->offset);
+#ifdef USE_IO_URING
+		if (req->viaring && ret >= 0)
+			/* pread works where io_uring gave -EINVAL */
+			s.noring = 1;
+#endif
+		e_complete(req, (ret < 0) ? -errno : ret);
+	}
 }
 
 /* exported API */
 int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat)
+{
+	return libe_add_fd_mask(fd, LIBE_RD, fn, dat);
+}
+
+int libe_add_fd_mask(int fd, int mask, void (*fn)(int fd, void *), const void *dat)
 {
 	struct event *t;
+	int newsize;
 
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd < s.sfds && s.fds[fd]) {
+		/* replace */
+		t = s.fds[fd];
+		t->fn = fn;
+		t->dat = (void *)dat;
+		return libe_mod_fd(fd, mask);
+	}
+	if (fd >= s.sfds) {
+		newsize = (fd + 16) & ~15;
+		s.fds = realloc(s.fds, sizeof(*s.fds)*newsize);
+		memset(s.fds+s.sfds, 0, sizeof(*s.fds)*(newsize - s.sfds));
+		s.sfds = newsize;
+	}
 	t = malloc(sizeof(*t));
 	/* don't test t since I don't know what to do if it was NULL
 	 * So, I just use it, and maybe we segfault, which is the best
@@ -93,60 +420,80 @@ int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat)
 	t->fd = fd;
 	t->fn = fn;
 	t->dat = (void *)dat;
+	t->mask = mask;
+
+	s.fds[fd] = t;
+	++s.nevents;
+	return e_ctl(EPOLL_CTL_ADD, t);
+}
 
-	t_add(t, &s.events);
-	if (s.epfd >= 0) {
-		struct epoll_event evdat = {
-			.events = EPOLLIN,
-			.data.ptr = t,
-		};
+int libe_mod_fd(int fd, int mask)
+{
+	struct event *t;
 
-		return epoll_ctl(s.epfd, EPOLL_CTL_ADD, fd, &evdat);
+	if (fd < 0 || fd >= s.sfds || !s.fds[fd]) {
+		errno = ENOENT;
+		return -1;
 	}
-	return 0;
+	t = s.fds[fd];
+	if (t->mask == mask)
+		return 0;
+	t->mask = mask;
+	return e_ctl(EPOLL_CTL_MOD, t);
+}
+
+int libe_events(void)
+{
+	return s.revents;
 }
 
 void libe_remove_fd(int fd)
 {
 	struct event *t;
-	int j;
 
-	for (t = s.events; t; t = t->next) {
-		if (t->fd == fd)
-			break;
-	}
-	if (t) {
-		/* alert? */
-		t_del(t);
-		free(t);
-		for (j = 0; j < s.nevs; ++j) {
-			if (s.evs[j].data.ptr == t)
-				/* clear this entry */
-				s.evs[j].data.ptr = NULL;
-		}
-	}
+	if (fd < 0 || fd >= s.sfds || !s.fds[fd])
+		return;
+	t = s.fds[fd];
+	s.fds[fd] = NULL;
+	--s.nevents;
 	if (s.epfd >= 0)
 		epoll_ctl(s.epfd, EPOLL_CTL_DEL, fd, 0);
+	/* the ready batch may still refer to it */
+	t->fd = -1;
+	t->next = s.garbage;
+	s.garbage = t;
 }
 
 /* main run */
 int libe_wait(int waitmsec)
 {
-	int ret;
-	struct event *t;
+	int ret, fd;
 
+	/* no batch refers to removed events anymore */
+	e_collect_garbage();
+#ifdef USE_IO_URING
+	if (s.tosubmit > 0) {
+		/* submit the batch of reads */
+		ret = e_uring_submit();
+		if (ret < 0)
+			return ret;
+	}
+	if (s.tosubmit > 0)
+		/* submission stopped early */
+		waitmsec = 0;
+#endif
+	if (s.ioreqs)
+		/* reads are pending */
+		waitmsec = 0;
 	if (s.epfd < 0) {
 		/* start EPOLL */
-		struct epoll_event evdat = {
-			.events = EPOLLIN,
-		};
-
-		ret = s.epfd = epoll_create(NEVS);
+		ret = s.epfd = epoll_create1(EPOLL_CLOEXEC);
 		if (ret < 0)
 			return ret;
-		for (t = s.events; t; t = t->next) {
-			evdat.data.ptr = t;
-			ret = epoll_ctl(s.epfd, EPOLL_CTL_ADD, t->fd, &evdat);
+		for (fd = 0; fd < s.sfds; ++fd) {
+			if (!s.fds[fd])
+				continue;
+			ret = e_ctl(EPOLL_CTL_ADD, s.fds[fd]);
 			if (ret < 0) {
 				close(s.epfd);
 				s.epfd = -1;
@@ -154,9 +501,16 @@ int libe_wait(int waitmsec)
 			}
 		}
 	}
+	if (!s.evs || (s.full && s.sevs < s.nevents)) {
+		/* the last batch was full, grow */
+		s.sevs = s.sevs ? s.sevs*2 : NEVS;
+		free(s.evs);
+		s.evs = malloc(sizeof(*s.evs)*s.sevs);
+	}
 
-	ret = epoll_wait(s.epfd, s.evs, NEVS, waitmsec);
+	ret = epoll_wait(s.epfd, s.evs, s.sevs, waitmsec);
 	s.nevs = (ret >= 0) ? ret : 0;
+	s.full = s.nevs >= s.sevs;
 	return ret;
 }
 
@@ -166,26 +520,51 @@ void libe_flush(void)
 	struct event *t;
 
 	for (j = 0; j < s.nevs; ++j) {
-		if (!s.evs[j].data.ptr)
-			// cleared by evt_remove
-			continue;
 		t = s.evs[j].data.ptr;
+		if (t->fd < 0)
+			/* removed by libe_remove_fd */
+			continue;
+		s.revents = ((s.evs[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? LIBE_RD : 0) |
+			((s.evs[j].events & EPOLLOUT) ? LIBE_WR : 0);
 		t->fn(t->fd, t->dat);
 	}
+	s.revents = 0;
 	s.nevs = 0;
+	e_collect_garbage();
+	e_flush_ioreqs();
 }
 
 /* cleanup storage */
 __attribute__((destructor))
 void libe_cleanup(void)
 {
-	struct event *t;
+	int fd;
+	struct ioreq *req;
 
-	while (s.events) {
-		t = s.events;
-		s.events = t->next;
-		free(t);
+#ifdef USE_IO_URING
+	e_uring_exit();
+#endif
+	while (s.freereqs) {
+		req = s.freereqs;
+		s.freereqs = req->next;
+		free(req);
+	}
+	while (s.ioreqs) {
+		req = s.ioreqs;
+		s.ioreqs = req->next;
+		free(req);
+	}
+
+	for (fd = 0; fd < s.sfds; ++fd) {
+		if (s.fds[fd])
+			free(s.fds[fd]);
 	}
+	e_collect_garbage();
+	free(s.fds);
+	free(s.evs);
 	if (s.epfd >= 0)
 		close(s.epfd);
+	memset(&s, 0, sizeof(s));
+	s.epfd = -1;
+	s.lastioreq = &s.ioreqs;
 }
@@ -18,6 +18,8 @@
  */
 #ifndef _libe_h_
 #define libe_h_
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,8 +27,27 @@ extern "C" {
 /* watch for events on <fd> */
 extern int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat);
 
+/* event mask */
+#define LIBE_RD		0x01
+#define LIBE_WR		0x02
+#define LIBE_ET		0x04 /* edge triggered */
+
+/* watch for events in <mask> on <fd>
+ * Adding a watched fd again replaces its handler and mask
+ */
+extern int libe_add_fd_mask(int fd, int mask, void (*fn)(int fd, void *), const void *dat);
+
+/* modify the event mask of a watched <fd> */
+extern int libe_mod_fd(int fd, int mask);
+
+/* events that triggered the running handler, LIBE_RD and/or LIBE_WR
+ * Errors and hangups are reported as LIBE_RD.
+ */
+extern int libe_events(void);
+
 /* remove a watched <fd>
- * Nothing happens when no matching timeout is found
+ * Nothing happens when no matching fd is found.
+ * This may be called from a handler.
  */
 extern void libe_remove_fd(int fd);
 
@@ -38,6 +59,16 @@ extern int libe_wait(int waitmsec);
  */
 extern void libe_flush(void);
 
+/* read <len> bytes at <offset> from <fd> into <buf>, asynchronously
+ * <fn> is called from libe_flush() when done, and retrieves
+ * the number of bytes read, or -errno, with libe_result().
+ * Reads queued before libe_wait() are submitted in 1 batch with io_uring,
+ * or done with pread() when io_uring is not available,
+ * or when its reads fail with -EINVAL (kernels before 5.6 lack IORING_OP_READ).
+ */
+extern int libe_pread(int fd, void *buf, int len, off_t offset, void (*fn)(int fd, void *), const void *dat);
+extern int libe_result(void);
+
 /* cleanup, called automatically on exit also
  * May be called twice.
  */
@@ -16,72 +16,261 @@
  * You should have received a copy of the GNU Lesser Public License
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 
 #include "libt.h"
 
 struct timer {
-	struct timer *next, *prev;
+	struct timer *hnext; /* hash chain on (fn, dat) */
+	struct timer *tmpnext; /* fired during libt_flush, or free list */
 	void (*fn)(void *dat);
 	void *dat;
-	double wakeup;
+	double wakeup; /* requested */
+	double slack;
+	double due; /* effective wakeup, within the slack */
+	double period; /* periodic handle timer */
+	unsigned long seq; /* keep the order of equal wakeups */
+	int idx; /* heap position, -1 when not scheduled */
+	int flags;
+		#define TF_HASHED	0x01
+		#define TF_FIRED	0x02
+		#define TF_HANDLE	0x04 /* owned by the application */
 };
 
 static struct {
-	struct timer *timers;
+	/* binary heap, earliest wakeup first */
+	struct timer **heap;
+	int nheap, sheap;
+	/* hash table on (fn, dat), size is power of 2 */
+	struct timer **hash;
+	int nhash, shash;
+	/* timers that fired in this libt_flush */
 	struct timer *tmptimers;
+	/* unused timers, for reuse */
+	struct timer *freetimers;
+	/* timerfd, programmed with the earliest wakeup */
+	int timerfd;
+	int usetimerfd;
+	int inflush;
+	double armed;
+	/* virtual clock */
+	int virtual;
+	double vnow;
+	unsigned long seq;
 } s;
 
-/* double-linked-list black magic:
- * The @prev member of the first element points to a 'fake' element
- * which is well-crafted so that assigning prev->next just happens
- * to set the root pointer
- * This function return the required 'fake' pointers
- */
-static inline struct timer *t_fakeelement(struct timer **root)
+/* binary heap */
+static inline int t_before(const struct timer *a, const struct timer *b)
+{
+	if (a->due != b->due)
+		return a->due < b->due;
+	return (long)(a->seq - b->seq) < 0;
+}
+
+static inline void t_place(struct timer *t, int idx)
+{
+	s.heap[idx] = t;
+	t->idx = idx;
+}
+
+static void t_up(struct timer *t, int idx)
+{
+	int parent;
+
+	for (; idx > 0; idx = parent) {
+		parent = (idx-1)/2;
+		if (!t_before(t, s.heap[parent]))
+			break;
+		t_place(s.heap[parent], idx);
+	}
+	t_place(t, idx);
+}
+
+static void t_down(struct timer *t, int idx)
 {
-	return (struct timer *)(((char *)root) - offsetof(struct timer, next));
+	int child;
 
+	for (;; idx = child) {
+		child = idx*2+1;
+		if (child >= s.nheap)
+			break;
+		if (child+1 < s.nheap && t_before(s.heap[child+1], s.heap[child]))
+			++child;
+		if (!t_before(s.heap[child], t))
+			break;
+		t_place(s.heap[child], idx);
+	}
+	t_place(t, idx);
 }
 
-/* double linked list */
 static void t_del(struct timer *t)
 {
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = t->prev = NULL;
+	struct timer *last;
+	int idx = t->idx;
+
+	if (idx < 0)
+		return;
+	t->idx = -1;
+	last = s.heap[--s.nheap];
+	if (last == t)
+		return;
+	/* fill the hole with the last element */
+	if (idx > 0 && t_before(last, s.heap[(idx-1)/2]))
+		t_up(last, idx);
+	else
+		t_down(last, idx);
+}
+
+/* slack:
+ * A timer with slack is delayed to the next multiple of a grid,
+ * the largest power of 2 not above its slack.
+ * Timers with similar slack thus share their wakeups.
+ */
+static double t_align(double wakeup, double slack)
+{
+	double grid;
+	long long n;
+
+	if (!(slack > 0))
+		return wakeup;
+	/* avoid libm */
+	for (grid = 1; grid > slack; grid /= 2);
+	for (; grid*2 <= slack; grid *= 2);
+	n = wakeup / grid;
+	if (n*grid < wakeup)
+		++n;
+	return n*grid;
 }
 
-static void t_add(struct timer *t, struct timer **root)
+static void t_schedule(struct timer *t)
 {
+	t->due = t_align(t->wakeup, t->slack);
 	t_del(t);
-	t->next = *root;
-	if (t->next) {
-		t->prev = t->next->prev;
-		t->next->prev = t;
-	} else
-		/* this is dirty: fake a timer struct, which will only be used
-		 * for setting the @next member
-		 */
-		t->prev = t_fakeelement(root);
-	t->prev->next = t;
+	t->seq = s.seq++;
+	if (s.nheap >= s.sheap) {
+		s.sheap += 128;
+		s.heap = realloc(s.heap, sizeof(*s.heap)*s.sheap);
+		/* see malloc in t_alloc */
+	}
+	t_up(t, s.nheap++);
 }
 
-static void t_add_sorted(struct timer *t, struct timer **root)
+/* hash index */
+static inline unsigned int t_hash(void (*fn)(void *), const void *dat)
 {
-	t_del(t);
-	/* iterate root until all smaller items have passed */
-	for (; *root; root = &(*root)->next) {
-		if (t->wakeup < (*root)->wakeup)
+	uintptr_t hash = (uintptr_t)fn ^ ((uintptr_t)dat * 2654435761U);
+
+	return hash ^ (hash >> 16);
+}
+
+static void t_grow_hash(void)
+{
+	struct timer **newhash, *t, *next;
+	int j, newsize, idx;
+
+	newsize = s.shash ? s.shash*2 : 256;
+	newhash = calloc(newsize, sizeof(*newhash));
+	for (j = 0; j < s.shash; ++j) {
+		for (t = s.hash[j]; t; t = next) {
+			next = t->hnext;
+			idx = t_hash(t->fn, t->dat) & (newsize-1);
+			t->hnext = newhash[idx];
+			newhash[idx] = t;
+		}
+	}
+	free(s.hash);
+	s.hash = newhash;
+	s.shash = newsize;
+}
+
+static void t_hash_add(struct timer *t)
+{
+	int idx;
+
+	if (s.nhash >= s.shash)
+		t_grow_hash();
+	idx = t_hash(t->fn, t->dat) & (s.shash-1);
+	t->hnext = s.hash[idx];
+	s.hash[idx] = t;
+	t->flags |= TF_HASHED;
+	++s.nhash;
+}
+
+static void t_hash_del(struct timer *t)
+{
+	struct timer **pt;
+
+	if (!(t->flags & TF_HASHED))
+		return;
+	for (pt = &s.hash[t_hash(t->fn, t->dat) & (s.shash-1)]; *pt; pt = &(*pt)->hnext) {
+		if (*pt == t) {
+			*pt = t->hnext;
 			break;
+		}
 	}
-	t_add(t, root);
+	t->flags &= ~TF_HASHED;
+	--s.nhash;
+}
+
+/* timer pool
+ * unused timers are kept for reuse, so a running program
+ * stops calling malloc & free for its timers
+ */
+static struct timer *t_alloc(void)
+{
+	struct timer *t;
+
+	t = s.freetimers;
+	if (t)
+		s.freetimers = t->tmpnext;
+	else
+		t = malloc(sizeof(*t));
+	/* don't test t since I don't know what to do if it was NULL
+	 * So, I just use it, and maybe we segfault, which is the best
+	 * I can imagine in that case
+	 */
+	memset(t, 0, sizeof(*t));
+	return t;
+}
+
+static void t_free(struct timer *t)
+{
+	t->tmpnext = s.freetimers;
+	s.freetimers = t;
+}
+
+/* timerfd */
+static void t_rearm(void)
+{
+#ifdef __linux__
+	struct itimerspec it = {};
+	double next;
+
+	if (!s.usetimerfd || s.inflush)
+		return;
+	next = s.nheap ? s.heap[0]->due : NAN;
+	if (next == s.armed || (isnan(next) && isnan(s.armed)))
+		return;
+	s.armed = next;
+	if (!isnan(next)) {
+		if (next <= 0)
+			/* 0 would disarm */
+			next = 1e-9;
+		it.it_value.tv_sec = next;
+		it.it_value.tv_nsec = (next - it.it_value.tv_sec)*1e9;
+	}
+	timerfd_settime(s.timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+#endif
 }
 
 /* local/private tools */
@@ -89,11 +278,9 @@ static struct timer *t_find(void (*fn)(void *), const void *dat)
 {
 	struct timer *t;
 
-	for (t = s.timers; t; t = t->next) {
-		if ((t->fn == fn) && (t->dat == dat))
-			return t;
-	}
-	for (t = s.tmptimers; t; t = t->next) {
+	if (!s.shash)
+		return NULL;
+	for (t = s.hash[t_hash(fn, dat) & (s.shash-1)]; t; t = t->hnext) {
 		if ((t->fn == fn) && (t->dat == dat))
 			return t;
 	}
@@ -103,6 +290,8 @@ static struct timer *t_find(void (*fn)(void *), const void *dat)
 /* exported API */
 double libt_now(void)
 {
+	if (s.virtual)
+		return s.vnow;
 #if defined(USE_GETTIMEOFDAY)
 	struct timeval t;
 	if (0 != gettimeofday(&t, 0))
@@ -117,13 +306,28 @@ double libt_now(void)
 }
 
 void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat)
+{
+	libt_add_timeout_slack(timeout, 0, fn, dat);
+}
+
+void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat)
+{
+	libt_add_timeouta_slack(wakeuptime, 0, fn, dat);
+}
+
+void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
+{
+	libt_repeat_timeout_slack(increment, 0, fn, dat);
+}
+
+void libt_add_timeout_slack(double timeout, double slack, void (*fn)(void *), const void *dat)
 {
 	if (isnan(timeout))
 		return;
-	libt_add_timeouta(timeout+libt_now(), fn, dat);
+	libt_add_timeouta_slack(timeout+libt_now(), slack, fn, dat);
 }
 
-void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat)
+void libt_add_timeouta_slack(double wakeuptime, double slack, void (*fn)(void *), const void *dat)
 {
 	struct timer *t;
 
@@ -131,20 +335,19 @@ void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat)
 		return;
 	t = t_find(fn, dat);
 	if (!t) {
-		t = malloc(sizeof(*t));
-		/* don't test t since I don't know what to do if it was NULL
-		 * So, I just use it, and maybe we segfault, which is the best
-		 * I can imagine in that case
-		 */
-		memset(t, 0, sizeof(*t));
+		t = t_alloc();
 		t->fn = fn;
 		t->dat = (void *)dat;
+		t->idx = -1;
+		t_hash_add(t);
 	}
 	t->wakeup = wakeuptime;
-	t_add_sorted(t, &s.timers);
+	t->slack = slack;
+	t_schedule(t);
+	t_rearm();
 }
 
-void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
+void libt_repeat_timeout_slack(double increment, double slack, void (*fn)(void *), const void *dat)
 {
 	struct timer *t;
 
@@ -152,10 +355,11 @@ void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
 		return;
 	t = t_find(fn, dat);
 	if (!t)
-		libt_add_timeout(increment, fn, dat);
+		libt_add_timeout_slack(increment, slack, fn, dat);
 	else {
 		double now = libt_now();
 
+		/* repeat from the requested wakeup, so slack does not accumulate */
 		t->wakeup += increment;
 		if (t->wakeup < now)
 			/* We're scheduling in the past.
@@ -164,7 +368,9 @@ void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
 			 * and mimic 'add' behaviour
 			 */
 			t->wakeup = now + increment;
-		t_add_sorted(t, &s.timers);
+		t->slack = slack;
+		t_schedule(t);
+		t_rearm();
 	}
 }
 
@@ -175,7 +381,11 @@ void libt_remove_timeout(void (*fn)(void *), const void *dat)
 	t = t_find(fn, dat);
 	if (t) {
 		t_del(t);
-		free(t);
+		t_hash_del(t);
+		/* fired timers are freed at the end of libt_flush */
+		if (!(t->flags & TF_FIRED))
+			t_free(t);
+		t_rearm();
 	}
 }
 
@@ -190,39 +400,204 @@ int libt_flush(void)
 	double now;
 	int cnt;
 
-	now = libt_now() +0.001;
+	/* waittimes in msec are rounded down, a timerfd is exact */
+	now = libt_now() + ((s.usetimerfd || s.virtual) ? 0 : 0.001);
 	cnt = 0;
-	while (s.timers) {
-		t = s.timers;
-		if (t->wakeup > now)
+	++s.inflush;
+	while (s.nheap) {
+		t = s.heap[0];
+		if (t->due > now)
 			break;
 		/*
 		 * move tries to garbage, for possible re-arm inside
 		 * the timer callback
 		 */
-		t_add(t, &s.tmptimers);
+		t_del(t);
+		if (t->flags & TF_HANDLE) {
+			if (t->period > 0) {
+				/* next period, skip missed ones, keep the phase */
+				t->wakeup += t->period;
+				if (t->wakeup <= now)
+					t->wakeup += ((long long)((now - t->wakeup)/t->period) + 1)*t->period;
+				t_schedule(t);
+			}
+		} else if (!(t->flags & TF_FIRED)) {
+			t->flags |= TF_FIRED;
+			t->tmpnext = s.tmptimers;
+			s.tmptimers = t;
+		}
 		t->fn(t->dat);
 		++cnt;
 	}
 	/* clean up cache */
 	while (s.tmptimers) {
 		t = s.tmptimers;
-		t_del(t);
-		free(t);
+		s.tmptimers = t->tmpnext;
+		t->flags &= ~TF_FIRED;
+		if (t->idx >= 0)
+			/* re-armed */
+			continue;
+		t_hash_del(t);
+		t_free(t);
 	}
+	--s.inflush;
+	t_rearm();
 	return cnt;
 }
 
+int libt_timerfd(void)
+{
+#ifdef __linux__
+#if defined(USE_GETTIMEOFDAY)
+	static const int clockid = CLOCK_REALTIME;
+#else
+	static const int clockid = CLOCK_MONOTONIC;
+#endif
+	if (s.usetimerfd)
+		return s.timerfd;
+	if (s.virtual) {
+		/* the virtual clock does not advance by itself */
+		errno = EINVAL;
+		return -1;
+	}
+	s.timerfd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s.timerfd < 0)
+		return -1;
+	s.usetimerfd = 1;
+	s.armed = NAN;
+	t_rearm();
+	return s.timerfd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void libt_flush_timerfd(int fd, void *dat)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		return;
+	/* the timerfd expired, program it again even for the same wakeup */
+	s.armed = NAN;
+	libt_flush();
+}
+
+/* handle based timers */
+static inline struct timer *t_handle(struct libt_timer *h)
+{
+	return (struct timer *)h;
+}
+
+struct libt_timer *libt_timer_new(void (*fn)(void *), const void *dat)
+{
+	struct timer *t;
+
+	t = t_alloc();
+	t->fn = fn;
+	t->dat = (void *)dat;
+	t->idx = -1;
+	t->flags = TF_HANDLE;
+	return (struct libt_timer *)t;
+}
+
+void libt_timer_free(struct libt_timer *h)
+{
+	if (!h)
+		return;
+	libt_timer_cancel(h);
+	t_free(t_handle(h));
+}
+
+void libt_timer_adda(struct libt_timer *h, double wakeuptime)
+{
+	struct timer *t = t_handle(h);
+
+	if (isnan(wakeuptime))
+		return;
+	t->wakeup = wakeuptime;
+	t->period = 0;
+	t_schedule(t);
+	t_rearm();
+}
+
+void libt_timer_add(struct libt_timer *h, double timeout)
+{
+	if (isnan(timeout))
+		return;
+	libt_timer_adda(h, timeout+libt_now());
+}
+
+void libt_timer_periodic(struct libt_timer *h, double period)
+{
+	struct timer *t = t_handle(h);
+
+	if (!(period > 0))
+		return;
+	t->wakeup = libt_now() + period;
+	t->period = period;
+	t_schedule(t);
+	t_rearm();
+}
+
+void libt_timer_slack(struct libt_timer *h, double slack)
+{
+	struct timer *t = t_handle(h);
+
+	t->slack = slack;
+	if (t->idx >= 0) {
+		t_schedule(t);
+		t_rearm();
+	}
+}
+
+void libt_timer_cancel(struct libt_timer *h)
+{
+	struct timer *t = t_handle(h);
+
+	if (t->idx < 0)
+		return;
+	t_del(t);
+	t_rearm();
+}
+
+int libt_timer_pending(const struct libt_timer *h)
+{
+	return ((const struct timer *)h)->idx >= 0;
+}
+
+void libt_virtual_clock(double start)
+{
+	s.virtual = 1;
+	s.vnow = start;
+}
+
+void libt_set_now(double now)
+{
+	if (s.virtual && now > s.vnow)
+		s.vnow = now;
+}
+
+int libt_idle(void)
+{
+	if (!s.nheap)
+		return -1;
+	if (s.virtual && s.heap[0]->due > s.vnow)
+		s.vnow = s.heap[0]->due;
+	return 0;
+}
+
 double libt_next_wakeup(void)
 {
-	return s.timers ? s.timers->wakeup : -1;
+	return s.nheap ? s.heap[0]->due : -1;
 }
 
 int libt_get_waittime(void)
 {
 	double tmp;
 
-	if (!s.timers)
+	if (!s.nheap)
 		return -1;
 	/* avoid integer overflows and use double
 	 * An integer overflow may result into a negative
@@ -231,7 +606,7 @@ int libt_get_waittime(void)
 	 * libt_get_waittime() for poll() runs away with the cpu
 	 * because the waittime is wrong.
 	 */
-	tmp = (s.timers->wakeup - libt_now()) * 1000;
+	tmp = (s.heap[0]->due - libt_now()) * 1000;
 	/* compute the max result value that we want to return.
 	 * This is 1/4 of the maximum int value
 	 */
@@ -249,15 +624,32 @@ __attribute__((destructor))
 void libt_cleanup(void)
 {
 	struct timer *t;
+	int j;
 
-	while (s.timers) {
-		t = s.timers;
-		s.timers = t->next;
-		free(t);
+	/* handle timers remain with the application */
+	for (j = 0; j < s.nheap; ++j)
+		s.heap[j]->idx = -1;
+	for (j = 0; j < s.shash; ++j) {
+		while (s.hash[j]) {
+			t = s.hash[j];
+			s.hash[j] = t->hnext;
+			if (!(t->flags & TF_FIRED))
+				free(t);
+		}
 	}
 	while (s.tmptimers) {
 		t = s.tmptimers;
-		s.tmptimers = t->next;
+		s.tmptimers = t->tmpnext;
+		free(t);
+	}
+	while (s.freetimers) {
+		t = s.freetimers;
+		s.freetimers = t->tmpnext;
 		free(t);
 	}
+	free(s.heap);
+	free(s.hash);
+	if (s.usetimerfd)
+		close(s.timerfd);
+	memset(&s, 0, sizeof(s));
 }
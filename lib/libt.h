@@ -37,6 +37,15 @@ extern void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat
  */
 extern void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat);
 
+/* variants of the above, that allow the timeout to run up to
+ * @slack seconds late.
+ * Timeouts with slack are grouped into fewer wakeups.
+ * The plain variants schedule without slack.
+ */
+extern void libt_add_timeouta_slack(double wakeuptime, double slack, void (*fn)(void *), const void *dat);
+extern void libt_add_timeout_slack(double timeout, double slack, void (*fn)(void *), const void *dat);
+extern void libt_repeat_timeout_slack(double increment, double slack, void (*fn)(void *), const void *dat);
+
 /* remove a scheduled timeout.
  * Nothing happens when no matching timeout is found
  */
@@ -59,6 +68,61 @@ extern double libt_next_wakeup(void);
  */
 extern int libt_get_waittime(void);
 
+/* program a timerfd with the earliest scheduled timeout
+ * The returned fd becomes readable when timeouts are due.
+ * Register it with libe_add_fd(fd, libt_flush_timerfd, NULL),
+ * so waiting for events covers the timeouts too.
+ * Returns -1 when timerfd is not available.
+ */
+extern int libt_timerfd(void);
+
+/* event handler for the timerfd, runs libt_flush() */
+extern void libt_flush_timerfd(int fd, void *dat);
+
+/* handle based timers
+ * A handle is owned by the application until libt_timer_free(),
+ * scheduled or not. Cancel and reschedule need no lookup,
+ * and handles don't collide with the (fn, dat) timeouts above.
+ */
+struct libt_timer;
+
+extern struct libt_timer *libt_timer_new(void (*fn)(void *), const void *dat);
+/* cancel & free, may be called from its callback */
+extern void libt_timer_free(struct libt_timer *t);
+
+/* schedule @timeout seconds from now, or at @wakeuptime.
+ * This replaces a previous schedule.
+ */
+extern void libt_timer_add(struct libt_timer *t, double timeout);
+extern void libt_timer_adda(struct libt_timer *t, double wakeuptime);
+
+/* run every @period seconds, the first time @period seconds from now
+ * The phase is kept: missed periods are skipped, without drift.
+ */
+extern void libt_timer_periodic(struct libt_timer *t, double period);
+
+/* allow the timer to run up to @slack seconds late, see above */
+extern void libt_timer_slack(struct libt_timer *t, double slack);
+
+extern void libt_timer_cancel(struct libt_timer *t);
+extern int libt_timer_pending(const struct libt_timer *t);
+
+/* use a virtual clock, for simulations and tests
+ * libt_now() then starts at @start, and only moves forward
+ * with libt_set_now() or libt_idle().
+ * Call this before scheduling any timeout.
+ */
+extern void libt_virtual_clock(double start);
+
+/* move the virtual clock forward to @now */
+extern void libt_set_now(double now);
+
+/* the program is idle: the virtual clock jumps to the earliest
+ * scheduled timeout, so libt_flush() runs it without waiting.
+ * Returns -1 when no timeout is scheduled.
+ */
+extern int libt_idle(void);
+
 /* cleanup, called automatically on exit also
  * May be called twice.
  */
@@ -0,0 +1,125 @@
+/* tests for the handle timers of libt, on a virtual clock */
+#include <stdio.h>
+
+#include "lib/libt.h"
+
+static int nerr;
+static void expect(const char *name, int value, int exp)
+{
+	if (value != exp) {
+		printf("%s: %i, expected %i\n", name, value, exp);
+		++nerr;
+	}
+}
+
+/* run the clock up to @until, like an idle event loop */
+static void run_until(double until)
+{
+	libt_flush();
+	while (libt_next_wakeup() >= 0 && libt_next_wakeup() <= until) {
+		libt_idle();
+		libt_flush();
+	}
+	libt_set_now(until);
+	libt_flush();
+}
+
+static struct libt_timer *timer;
+static int nruns;
+static double lastrun;
+
+static void count(void *dat)
+{
+	++nruns;
+	lastrun = libt_now();
+}
+
+static void cancel_3rd(void *dat)
+{
+	count(dat);
+	if (nruns >= 3)
+		libt_timer_cancel(timer);
+}
+
+static void free_self(void *dat)
+{
+	count(dat);
+	libt_timer_free(timer);
+	timer = NULL;
+}
+
+static void rearm_self(void *dat)
+{
+	count(dat);
+	if (nruns < 4)
+		libt_timer_add(timer, 2);
+}
+
+static void test_cancel_from_callback(void)
+{
+	nruns = 0;
+	timer = libt_timer_new(cancel_3rd, NULL);
+	libt_timer_periodic(timer, 1);
+	run_until(libt_now() + 10);
+	expect("cancel from callback, runs", nruns, 3);
+	expect("cancel from callback, pending", libt_timer_pending(timer), 0);
+	libt_timer_free(timer);
+}
+
+static void test_free_from_callback(void)
+{
+	nruns = 0;
+	timer = libt_timer_new(free_self, NULL);
+	libt_timer_periodic(timer, 1);
+	run_until(libt_now() + 10);
+	expect("free from callback, runs", nruns, 1);
+	expect("free from callback, scheduled", libt_next_wakeup() >= 0, 0);
+}
+
+static void test_rearm_from_callback(void)
+{
+	double start = libt_now();
+
+	nruns = 0;
+	timer = libt_timer_new(rearm_self, NULL);
+	libt_timer_add(timer, 2);
+	run_until(start + 20);
+	expect("re-arm from callback, runs", nruns, 4);
+	expect("re-arm from callback, last", lastrun == start + 8, 1);
+	libt_timer_free(timer);
+}
+
+static void test_periodic_phase(void)
+{
+	double start = libt_now();
+
+	nruns = 0;
+	timer = libt_timer_new(count, NULL);
+	libt_timer_periodic(timer, 1);
+	run_until(start + 2);
+	expect("periodic, runs", nruns, 2);
+	/* a late loop skips the missed periods, and keeps the phase */
+	libt_set_now(start + 5.5);
+	libt_flush();
+	expect("periodic late, runs", nruns, 3);
+	expect("periodic late, next", libt_next_wakeup() == start + 6, 1);
+	/* periodic again replaces the schedule */
+	libt_timer_periodic(timer, 2);
+	expect("periodic re-arm, next", libt_next_wakeup() == start + 7.5, 1);
+	run_until(start + 11.5);
+	expect("periodic re-arm, runs", nruns, 6);
+	libt_timer_free(timer);
+}
+
+int main(int argc, char *argv[])
+{
+	libt_virtual_clock(0);
+
+	test_cancel_from_callback();
+	test_free_from_callback();
+	test_rearm_from_callback();
+	test_periodic_phase();
+
+	printf("%i errors\n", nerr);
+	return !!nerr;
+}
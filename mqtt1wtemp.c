@@ -20,6 +20,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqtt1wtemp"
 #ifndef VERSION
@@ -241,7 +242,7 @@ static void pubvalue(void *dat)
 	else
 		strcpy(it->lastvalue, buf);
 done:
-	libt_repeat_timeout(60, pubvalue, dat);
+	libt_repeat_timeout_slack(60, 1, pubvalue, dat);
 }
 
 static void w1temp_publish_all(void *dat)
@@ -279,7 +280,7 @@ static void w1temp_publish_all(void *dat)
 		}
 		globfree(&gl);
 	}
-	libt_add_timeout(60, w1temp_publish_all, dat);
+	libt_add_timeout_slack(60, 1, w1temp_publish_all, dat);
 }
 
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
@@ -342,7 +343,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -407,14 +408,10 @@ int main(int argc, char *argv[])
 	}
 
 	w1temp_publish_all(NULL);
+
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
@@ -23,6 +23,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttled"
 #ifndef VERSION
@@ -414,7 +415,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -496,14 +497,9 @@ int main(int argc, char *argv[])
 	sigaction(SIGTERM, &(struct sigaction){ .sa_handler = onsigterm, }, NULL);
 	sigaction(SIGINT, &(struct sigaction){ .sa_handler = onsigterm, }, NULL);
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (!sigterm) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	/* blank all leds (sigterm set) */
 	spi_write_apa102(NULL);
@@ -20,6 +20,7 @@
 #include <mosquitto.h>
 
 #include "common.h"
+#include "evloop.h"
 #include "lib/libt.h"
 #include "lib/libe.h"
 
@@ -36,6 +37,7 @@ static const char help_msg[] =
 	"Options\n"
 	" -V, --version		Show version\n"
 	" -v, --verbose		Be more verbose\n"
+	" -a, --asynclog		Log from a background thread, drop messages rather than block\n"
 	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
 	" -s, --suffix=STR	Give MQTT topic suffix for spec (default '/iiohw')\n"
 	" -N, --nomqtt		Only emit incoming event without propagating to MQTT\n"
@@ -49,6 +51,7 @@ static struct option long_opts[] = {
 	{ "help", no_argument, NULL, '?', },
 	{ "version", no_argument, NULL, 'V', },
 	{ "verbose", no_argument, NULL, 'v', },
+	{ "asynclog", no_argument, NULL, 'a', },
 
 	{ "mqtt", required_argument, NULL, 'm', },
 	{ "suffix", required_argument, NULL, 's', },
@@ -60,10 +63,11 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:s:N";
+static const char optstring[] = "Vv?am:s:N";
 
 /* logging */
 static int loglevel = LOG_WARNING;
+static int asynclog;
 
 /* signal handler */
 static volatile int sigterm;
@@ -746,17 +750,6 @@ done_device: ;
 done_elements: ;
 }
 
-static void mqtt_fd_ready(int fd, void *dat)
-{
-	struct mosquitto *mosq = dat;
-	int ret;
-
-	/* mqtt read ... */
-	ret = mosquitto_loop_read(mosq, 1);
-	if (ret)
-		mylog(LOG_ERR, "mosquitto_loop_read: %s", mosquitto_strerror(ret));
-}
-
 int main(int argc, char *argv[])
 {
 	int opt, ret;
@@ -774,6 +767,9 @@ int main(int argc, char *argv[])
 	case 'v':
 		++loglevel;
 		break;
+	case 'a':
+		asynclog = 1;
+		break;
 	case 'm':
 		mqtt_host = optarg;
 		str = strrchr(optarg, ':');
@@ -802,6 +798,8 @@ int main(int argc, char *argv[])
 
 	myopenlog(NAME, 0, LOG_LOCAL2);
 	myloglevel(loglevel);
+	if (asynclog && myasynclog(1024) < 0)
+		mylog(LOG_ERR, "asynchronous logging: %s", ESTR(errno));
 
 	/* MQTT start */
 	if (!nomqtt) {
@@ -828,32 +826,14 @@ int main(int argc, char *argv[])
 			if (ret)
 				mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 		}
-		libe_add_fd(mosquitto_socket(mosq), mqtt_fd_ready, mosq);
 	}
 
 	/* prepare epoll */
 	scan_iio(0);
+	evloop_init(nomqtt ? NULL : mosq, mqtt_keepalive);
 
-	while (1) {
-		libt_flush();
-		ret = libe_wait(libt_get_waittime());
-		if (ret < 0 && errno == EINTR)
-			continue;
-		if (ret < 0)
-			mylog(LOG_ERR, "libe_wait ...: %s", ESTR(errno));
-		libe_flush();
-		if (!nomqtt) {
-			/* mosquitto things to do each iteration */
-			ret = mosquitto_loop_misc(mosq);
-			if (ret)
-				mylog(LOG_ERR, "mosquitto_loop_misc: %s", mosquitto_strerror(ret));
-			if (mosquitto_want_write(mosq)) {
-				ret = mosquitto_loop_write(mosq, 1);
-				if (ret)
-					mylog(LOG_ERR, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
-			}
-		}
-	}
+	while (1)
+		evloop_iterate(-1);
 
 	/* close all IIO */
 	scan_iio(1);
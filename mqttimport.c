@@ -16,6 +16,7 @@
 #include <mosquitto.h>
 
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttimport"
 #ifndef VERSION
@@ -315,10 +316,8 @@ printhelp:
 	send_self_sync(mosq, mqtt_qos);
 
 	/* loop */
-	while (!sigterm && items) {
-		ret = mosquitto_loop(mosq, 1000, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
-	}
+	evloop_init(mosq, mqtt_keepalive);
+	while (!sigterm && items)
+		evloop_iterate(-1);
 	return 0;
 }
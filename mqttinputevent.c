@@ -13,13 +13,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
 #include <syslog.h>
 #include <sys/stat.h>
 #include <mosquitto.h>
 #include <linux/input.h>
 
 #include "common.h"
+#include "evloop.h"
+#include "lib/libe.h"
 
 #define NAME "mqttinputevent"
 #ifndef VERSION
@@ -285,16 +286,44 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 	}
 }
 
-int main(int argc, char *argv[])
+static void input_ready(int fd, void *dat)
 {
-	int opt, ret, j, cnt, nevs;
+	int ret, j, cnt, nevs;
 	struct item *it;
-	char *str;
-	char mqtt_name[32];
-	struct pollfd pf[2];
 	struct input_event evs[16];
 	char valuestr[32];
 
+	ret = read(fd, evs, sizeof(evs));
+	if (ret < 0)
+		mylog(LOG_ERR, "read %s: %s", inputdev, ESTR(errno));
+	nevs = ret/sizeof(*evs);
+	for (j = 0; j < nevs; ++j) {
+		if (evs[j].type == EV_SYN || evs[j].type == EV_MSC)
+			/* ignore SYN events here */
+			continue;
+		cnt = 0;
+		for (it = items; it; it = it->next) {
+			if (it->evtype != evs[j].type || it->evcode != evs[j].code)
+				continue;
+			sprintf(valuestr, "%i", evs[j].value);
+			pubitem(it, valuestr);
+			++cnt;
+		}
+		if (!cnt) {
+			sprintf(valuestr, "%u:%u %i", evs[j].type, evs[j].code, evs[j].value);
+			ret = mosquitto_publish(mosq, NULL, mqtt_unknown_topic, strlen(valuestr), valuestr, mqtt_qos, 0);
+			if (ret < 0)
+				mylog(LOG_ERR, "mosquitto_publish %s: %s", mqtt_unknown_topic, mosquitto_strerror(ret));
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret;
+	char *str;
+	char mqtt_name[32];
+
 	/* argument parsing */
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
 	switch (opt) {
@@ -366,59 +395,10 @@ int main(int argc, char *argv[])
 			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 	}
 
-	/* prepare poll */
-	pf[0].fd = infd;
-	pf[0].events = POLL_IN;
-	pf[1].fd = mosquitto_socket(mosq);
-	pf[1].events = POLL_IN;
+	libe_add_fd(infd, input_ready, NULL);
+	evloop_init(mosq, mqtt_keepalive);
 
-	while (1) {
-		ret = poll(pf, 2, 1000);
-		if (ret < 0 && errno == EINTR)
-			continue;
-		if (ret < 0)
-			mylog(LOG_ERR, "poll ...");
-		if (pf[0].revents) {
-			/* read input events */
-			ret = read(infd, evs, sizeof(evs));
-			if (ret < 0)
-				mylog(LOG_ERR, "read %s: %s", inputdev, ESTR(errno));
-			nevs = ret/sizeof(*evs);
-			for (j = 0; j < nevs; ++j) {
-				if (evs[j].type == EV_SYN || evs[j].type == EV_MSC)
-					/* ignore SYN events here */
-					continue;
-				cnt = 0;
-				for (it = items; it; it = it->next) {
-					if (it->evtype != evs[j].type || it->evcode != evs[j].code)
-						continue;
-					sprintf(valuestr, "%i", evs[j].value);
-					pubitem(it, valuestr);
-					++cnt;
-				}
-				if (!cnt) {
-					sprintf(valuestr, "%u:%u %i", evs[j].type, evs[j].code, evs[j].value);
-					ret = mosquitto_publish(mosq, NULL, mqtt_unknown_topic, strlen(valuestr), valuestr, mqtt_qos, 0);
-					if (ret < 0)
-						mylog(LOG_ERR, "mosquitto_publish %s: %s", mqtt_unknown_topic, mosquitto_strerror(ret));
-				}
-			}
-		}
-		if (pf[1].revents) {
-			/* mqtt read ... */
-			ret = mosquitto_loop_read(mosq, 1);
-			if (ret)
-				mylog(LOG_ERR, "mosquitto_loop_read: %s", mosquitto_strerror(ret));
-		}
-		/* mosquitto things to do each iteration */
-		ret = mosquitto_loop_misc(mosq);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop_misc: %s", mosquitto_strerror(ret));
-		if (mosquitto_want_write(mosq)) {
-			ret = mosquitto_loop_write(mosq, 1);
-			if (ret)
-				mylog(LOG_ERR, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
-		}
-	}
+	while (1)
+		evloop_iterate(-1);
 	return 0;
 }
@@ -18,6 +18,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttled"
 #ifndef VERSION
@@ -403,7 +404,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -469,14 +470,9 @@ int main(int argc, char *argv[])
 			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 	}
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
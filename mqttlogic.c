@@ -19,6 +19,7 @@
 #include "lib/libt.h"
 #include "rpnlogic.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttlogic"
 #ifndef VERSION
@@ -33,11 +34,15 @@ static const char help_msg[] =
 	"Options\n"
 	" -V, --version		Show version\n"
 	" -v, --verbose		Be more verbose\n"
+	" -a, --asynclog		Log from a background thread, drop messages rather than block\n"
 	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
 	" -s, --suffix=STR	Give MQTT topic suffix for scripts (default '/logic')\n"
 	" -S, --setsuffix=STR	Give MQTT topic suffix for scripts that write to /set (default '/setlogic')\n"
 	" -c, --onchange=STR	Give MQTT topic suffix for onchange handler scripts (default '/onchange')\n"
 	" -w, --write=STR	Give MQTT topic suffix for writing the topic on /logicw (default /set)\n"
+	" -n, --narrow		Without PATTERN, don't subscribe to '#' but only to\n"
+	"			scripts up to LEVELS deep and the topics they use\n"
+	" -l, --levels=LEVELS	Depth of the scripts for --narrow (default 8)\n"
 	"\n"
 	"Paramteres\n"
 	" PATTERN	A pattern to subscribe for\n"
@@ -48,12 +53,15 @@ static struct option long_opts[] = {
 	{ "help", no_argument, NULL, '?', },
 	{ "version", no_argument, NULL, 'V', },
 	{ "verbose", no_argument, NULL, 'v', },
+	{ "asynclog", no_argument, NULL, 'a', },
 
 	{ "mqtt", required_argument, NULL, 'm', },
 	{ "suffix", required_argument, NULL, 's', },
 	{ "Suffix", required_argument, NULL, 'S', },
 	{ "onchange", required_argument, NULL, 'c', },
 	{ "write", required_argument, NULL, 'w', },
+	{ "narrow", no_argument, NULL, 'n', },
+	{ "levels", required_argument, NULL, 'l', },
 
 	{ },
 };
@@ -61,10 +69,11 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:s:S:c:w:";
+static const char optstring[] = "Vv?am:s:S:c:w:nl:";
 
 /* logging */
 static int loglevel = LOG_WARNING;
+static int asynclog;
 
 /* signal handler */
 static volatile int sigterm;
@@ -78,9 +87,19 @@ static const char *mqtt_onchangesuffix = "/onchange";
 static const char *mqtt_write_suffix = "/set";
 static int mqtt_keepalive = 10;
 static int mqtt_qos = 1;
+/* subscribe to the used topics only, scripts up to this level */
+static int narrow;
+static int narrowlevels = 8;
 
 /* state */
 static struct mosquitto *mosq;
+/* the retained messages are received,
+ * no logic is evaluated before, so all starts with a complete cache.
+ * New subscriptions clear it again.
+ */
+static int synced;
+/* the first sync is received */
+static int started;
 
 struct item {
 	struct item *next;
@@ -96,6 +115,18 @@ struct item {
 
 	struct rpn *logic;
 	struct rpn *onchange;
+
+	/* the topic of this item */
+	struct topic *self;
+	/* evaluation queue */
+	struct item *qnext;
+	int queued;
+	int level; /* evaluation order, after the logic that it depends on */
+	int levelgen;
+	int evalgen; /* batch in which the logic was evaluated */
+	int trigger; /* why it is queued */
+		#define TRIG_SELF	1 /* its own topic changed */
+		#define TRIG_OTHER	2 /* any other reason */
 };
 
 static struct item *items;
@@ -103,15 +134,44 @@ static struct item *items;
 static struct stack rpnstack;
 
 /* topic cache */
+struct logicdep {
+	struct item *it;
+	struct rpn *root; /* it->logic or it->onchange */
+	struct rpn *rpn; /* token that refers to the topic */
+	int isnew; /* the logic tests 'isnew' on the topic */
+};
+
 struct topic {
+	struct topic *hnext; /* hash chain */
 	char *topic;
 	char *value;
-	int ref;
+	double dvalue; /* parsed value, NAN when not numeric */
 	int isnew;
+	struct topic *newnext; /* list of new topics in this batch */
+	char *deferred; /* 2nd value during a flush, for the next batch */
+	struct topic *defernext;
+	/* our own writes, in order, that did not return yet */
+	char **echoes;
+	int nechoes, sechoes;
+	/* item for this topic */
+	struct item *item;
+	/* usage changes, dynamic subscription */
+	struct topic *subnext;
+	int subqueued;
+	int subscribed;
+	/* fetching the retained value */
+	struct topic *fetchnext;
+	int fetching; /* 1: in progress, 2: done */
+	/* logic that refers to this topic */
+	struct logicdep *deps;
+	int ndeps, sdeps;
 };
-static struct topic *topics;
+/* hash table of topics,
+ * a topic never moves in memory, until dropped when unused
+ */
+static struct topic **topics;
 static int ntopics; /* used topics */
-static int stopics;
+static int stopics; /* hash table size, power of 2 */
 
 #define myfree(x) ({ if (x) { free(x); (x) = NULL; }})
 
@@ -137,39 +197,339 @@ static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const
 }
 
 /* mqtt cache */
-static int rpn_has_ref(struct rpn *rpn, const char *topic);
+static unsigned int topichash(const char *str)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261U;
+
+	for (; *str; ++str)
+		hash = (hash ^ *(const unsigned char *)str) * 16777619U;
+	return hash;
+}
 
-static int topiccmp(const void *a, const void *b)
+static void grow_topics(void)
 {
-	return strcmp(((const struct topic *)a)->topic ?: "", ((const struct topic *)b)->topic ?: "");
+	struct topic **newtopics, *topic, *next;
+	int j, newsize, idx;
+
+	newsize = stopics ? stopics*2 : 1024;
+	newtopics = malloc(sizeof(*newtopics)*newsize);
+	if (!newtopics)
+		mylog(LOG_ERR, "malloc %u topics failed", newsize);
+	memset(newtopics, 0, sizeof(*newtopics)*newsize);
+	/* rehash */
+	for (j = 0; j < stopics; ++j) {
+		for (topic = topics[j]; topic; topic = next) {
+			next = topic->hnext;
+			idx = topichash(topic->topic) & (newsize-1);
+			topic->hnext = newtopics[idx];
+			newtopics[idx] = topic;
+		}
+	}
+	if (topics)
+		free(topics);
+	topics = newtopics;
+	stopics = newsize;
 }
 
 struct topic *get_topic(const char *name, int create)
 {
 	struct topic *topic;
-	struct topic ref = { .topic = (char *)name, };
-	struct item *it;
+	unsigned int hash;
 
-	topic = bsearch(&ref, topics, ntopics, sizeof(*topics), topiccmp);
-	if (topic)
-		return topic;
+	hash = topichash(name);
+	if (stopics) {
+		for (topic = topics[hash & (stopics-1)]; topic; topic = topic->hnext) {
+			if (!strcmp(topic->topic, name))
+				return topic;
+		}
+	}
 	if (!create)
 		return NULL;
 	/* make room */
-	if (ntopics >= stopics) {
-		stopics += 128;
-		topics = realloc(topics, sizeof(*topics)*stopics);
+	if (ntopics >= stopics)
+		grow_topics();
+	topic = malloc(sizeof(*topic));
+	if (!topic)
+		mylog(LOG_ERR, "malloc topic failed");
+	*topic = (struct topic){
+		.topic = strdup(name),
+		.dvalue = NAN,
+		.hnext = topics[hash & (stopics-1)],
+	};
+	topics[hash & (stopics-1)] = topic;
+	++ntopics;
+	return topic;
+}
+
+/* topic usage:
+ * A topic is used while any item refers to it.
+ * In narrow mode, used topics are subscribed.
+ * Otherwise, values of unused topics are not kept once started,
+ * and a newly used topic without value fetches its retained value.
+ * A topic that the patterns cover subscribes its pattern again, so the
+ * broker replaces that subscription and sends its retained values.
+ * The values we have already are not taken from it.
+ * Any other topic gets a subscription that lasts until the next sync.
+ * Logic is held until the retained messages of new subscriptions are in.
+ * Unused topics are collected, and dropped after each batch of messages,
+ * so replacing a script does not unsubscribe & subscribe again.
+ */
+static struct topic *subqueue;
+static struct topic *fetchtopics;
+static int resync; /* new subscriptions need a sync */
+static int sweep; /* drop all unused topics */
+
+/* subscribed patterns, when not narrow */
+static struct pattern {
+	char *pattern;
+	int refetch; /* subscribed again to fetch a topic */
+} *patterns;
+static int npatterns, spatterns;
+static int refetching; /* any pattern is subscribed again */
+
+static void subscribe_pattern(const char *pattern)
+{
+	int ret;
+
+	ret = mosquitto_subscribe(mosq, NULL, pattern, mqtt_qos);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_subscribe %s: %s", pattern, mosquitto_strerror(ret));
+	if (npatterns >= spatterns) {
+		spatterns += 16;
+		patterns = realloc(patterns, sizeof(*patterns)*spatterns);
+		if (!patterns)
+			mylog(LOG_ERR, "realloc patterns %u failed", spatterns);
 	}
-	topics[ntopics++] = (struct topic){ .topic = strdup(name), };
-	qsort(topics, ntopics, sizeof(*topics), topiccmp);
-	topic = get_topic(name, 0);
+	patterns[npatterns++] = (struct pattern){ .pattern = strdup(pattern), };
+}
 
-	/* set already referenced topics */
-	for (it = items; it; it = it->next) {
-		if (rpn_has_ref(it->logic, name))
-			topic->ref += 1;
+/* test if an MQTT subscription pattern matches topic */
+static int pattern_match(const char *pattern, const char *topic)
+{
+	for (;;) {
+		if (!strcmp(pattern, "#"))
+			return 1;
+		if (*pattern == '+' && (!pattern[1] || pattern[1] == '/')) {
+			/* any 1 level */
+			topic += strcspn(topic, "/");
+			++pattern;
+		} else for (; *pattern && *pattern != '/'; ++pattern, ++topic) {
+			if (*pattern != *topic)
+				return 0;
+		}
+		if (!*pattern)
+			return !*topic;
+		if (*topic != '/')
+			/* 'a/#' matches 'a' too */
+			return !strcmp(pattern, "/#") && !*topic;
+		++pattern;
+		++topic;
 	}
-	return topic;
+}
+
+static struct pattern *covering_pattern(const char *topic)
+{
+	int j;
+
+	for (j = 0; j < npatterns; ++j) {
+		if (pattern_match(patterns[j].pattern, topic))
+			return patterns+j;
+	}
+	return NULL;
+}
+
+static void want_topic(struct topic *topic)
+{
+	struct pattern *pat;
+	const char *sub;
+	int ret;
+
+	sub = topic->topic;
+	if (narrow) {
+		if (topic->subscribed)
+			return;
+		topic->subscribed = 1;
+		mylog(LOG_INFO, "subscribe %s", topic->topic);
+	} else {
+		if (!started || topic->value || topic->fetching)
+			return;
+		topic->fetching = 1;
+		topic->fetchnext = fetchtopics;
+		fetchtopics = topic;
+		pat = covering_pattern(topic->topic);
+		if (pat) {
+			/* a 2nd subscription would deliver each message twice */
+			mylog(LOG_INFO, "fetch %s via %s", topic->topic, pat->pattern);
+			if (pat->refetch)
+				return;
+			pat->refetch = 1;
+			refetching = 1;
+			sub = pat->pattern;
+		} else
+			mylog(LOG_INFO, "fetch %s", topic->topic);
+	}
+	ret = mosquitto_subscribe(mosq, NULL, sub, mqtt_qos);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_subscribe %s: %s", sub, mosquitto_strerror(ret));
+	resync = 1;
+	synced = 0;
+}
+
+static void queue_subscription(struct topic *topic)
+{
+	if (topic->subqueued)
+		return;
+	topic->subqueued = 1;
+	topic->subnext = subqueue;
+	subqueue = topic;
+}
+
+/* echoes of our own writes */
+static void push_echo(struct topic *topic, const char *value)
+{
+	if (topic->nechoes >= topic->sechoes) {
+		topic->sechoes += 4;
+		topic->echoes = realloc(topic->echoes, sizeof(*topic->echoes)*topic->sechoes);
+		if (!topic->echoes)
+			mylog(LOG_ERR, "realloc echoes %u failed", topic->sechoes);
+	}
+	topic->echoes[topic->nechoes++] = strdup(value);
+}
+
+/* test if the message is the oldest echo, and consume it */
+static int pop_echo(struct topic *topic, const char *payload, int len)
+{
+	if (!topic->nechoes || strlen(topic->echoes[0]) != len ||
+			strncmp(topic->echoes[0], payload ?: "", len))
+		return 0;
+	free(topic->echoes[0]);
+	--topic->nechoes;
+	memmove(topic->echoes, topic->echoes+1, sizeof(*topic->echoes)*topic->nechoes);
+	return 1;
+}
+
+static void flush_echoes(struct topic *topic)
+{
+	for (; topic->nechoes; --topic->nechoes)
+		free(topic->echoes[topic->nechoes-1]);
+	myfree(topic->echoes);
+	topic->sechoes = 0;
+}
+
+static void drop_topic(struct topic *topic)
+{
+	struct topic **pp;
+
+	for (pp = &topics[topichash(topic->topic) & (stopics-1)]; *pp; pp = &(*pp)->hnext) {
+		if (*pp == topic) {
+			*pp = topic->hnext;
+			break;
+		}
+	}
+	--ntopics;
+	flush_echoes(topic);
+	myfree(topic->deps);
+	myfree(topic->value);
+	free(topic->topic);
+	free(topic);
+}
+
+static int topic_droppable(struct topic *topic)
+{
+	/* keep topics that are referenced from any list */
+	return !topic->ndeps && !topic->item && !topic->subscribed &&
+		!topic->isnew && topic->fetching != 1 && !topic->subqueued;
+}
+
+static void end_fetch(void)
+{
+	struct topic *topic;
+	int j, ret;
+
+	while (fetchtopics) {
+		topic = fetchtopics;
+		fetchtopics = topic->fetchnext;
+		topic->fetching = 2;
+		/* the patterns stay */
+		if (!covering_pattern(topic->topic)) {
+			ret = mosquitto_unsubscribe(mosq, NULL, topic->topic);
+			if (ret)
+				mylog(LOG_ERR, "mosquitto_unsubscribe %s: %s", topic->topic, mosquitto_strerror(ret));
+		}
+		/* it may be unused by now */
+		queue_subscription(topic);
+	}
+	for (j = 0; j < npatterns; ++j)
+		patterns[j].refetch = 0;
+	refetching = 0;
+}
+
+static void flush_subscriptions(void)
+{
+	struct topic *topic, *next;
+	int j, ret;
+
+	while (subqueue) {
+		topic = subqueue;
+		subqueue = topic->subnext;
+		topic->subqueued = 0;
+
+		if (topic->ndeps || topic->item)
+			continue;
+		if (topic->subscribed) {
+			topic->subscribed = 0;
+			mylog(LOG_INFO, "unsubscribe %s", topic->topic);
+			ret = mosquitto_unsubscribe(mosq, NULL, topic->topic);
+			if (ret)
+				mylog(LOG_ERR, "mosquitto_unsubscribe %s: %s", topic->topic, mosquitto_strerror(ret));
+		}
+		if ((narrow || started) && topic_droppable(topic))
+			drop_topic(topic);
+	}
+	if (sweep) {
+		/* forget the topics that were cached during startup */
+		sweep = 0;
+		for (j = 0; j < stopics; ++j) {
+			for (topic = topics[j]; topic; topic = next) {
+				next = topic->hnext;
+				if (topic_droppable(topic))
+					drop_topic(topic);
+			}
+		}
+	}
+	if (resync) {
+		/* sync again, after the retained messages of the new subscriptions */
+		resync = 0;
+		send_self_sync(mosq, mqtt_qos);
+	}
+}
+
+static void subscribe_suffix(const char *suffix)
+{
+	char *pattern;
+	int j, ret;
+
+	if (*suffix != '/') {
+		mylog(LOG_WARNING, "suffix '%s' does not start with '/', subscribe to '#'", suffix);
+		ret = mosquitto_subscribe(mosq, NULL, "#", mqtt_qos);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_subscribe '#': %s", mosquitto_strerror(ret));
+		return;
+	}
+	/* MQTT wildcards can't match a suffix, so subscribe for each level */
+	pattern = malloc(narrow*2 + strlen(suffix) + 1);
+	if (!pattern)
+		mylog(LOG_ERR, "malloc failed?");
+	for (j = 0; j < narrow; ++j) {
+		pattern[j*2] = '+';
+		strcpy(pattern+j*2+1, suffix);
+		ret = mosquitto_subscribe(mosq, NULL, pattern, mqtt_qos);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", pattern, mosquitto_strerror(ret));
+		pattern[j*2+1] = '/';
+	}
+	free(pattern);
 }
 
 static struct topic *lastrpntopic;
@@ -178,16 +538,19 @@ int rpn_env_isnew(void)
 	return lastrpntopic->isnew;
 }
 
-const char *rpn_lookup_env(const char *name, struct rpn *rpn)
+const char *rpn_lookup_env(const char *name, struct rpn *rpn, double *pvalue)
 {
 	struct topic *topic;
 
-	topic = get_topic(name, 0);
+	/* tokens are bound to their topic in rpn_ref() */
+	topic = rpn->env ?: get_topic(name, 0);
 	lastrpntopic = topic;
-	if (!topic) {
+	if (!topic || !topic->value) {
 		mylog(LOG_INFO, "topic %s not found", name);
+		*pvalue = NAN;
 		return NULL;
 	}
+	*pvalue = topic->dvalue;
 	return topic->value;
 }
 
@@ -218,29 +581,64 @@ static void rpn_resolve_relative(struct rpn *rpn, const char *topic)
 	}
 }
 
+/* does the logic test 'isnew' after reading topic <rpn> */
+static int rpn_tests_isnew(struct rpn *rpn)
+{
+	for (rpn = rpn->next; rpn && !rpn->topic; rpn = rpn->next) {
+		if (!strcmp(rpn_token_class(rpn), "isnew"))
+			return 1;
+	}
+	return 0;
+}
+
 /* logic items */
-static void rpn_add_ref(struct rpn *rpn, int add)
+static void rpn_ref(struct item *it, struct rpn *root)
 {
 	struct topic *topic;
+	struct rpn *rpn;
 
-	for (; rpn; rpn = rpn->next) {
+	for (rpn = root; rpn; rpn = rpn->next) {
 		if (!rpn->topic)
 			continue;
-		topic = get_topic(rpn->topic, 0);
-		if (!topic)
-			continue;
-		topic->ref += add;
+		/* create & bind the topic, so a later value finds its logic */
+		topic = get_topic(rpn->topic, 1);
+		rpn->env = topic;
+		if (topic->ndeps >= topic->sdeps) {
+			topic->sdeps += 4;
+			topic->deps = realloc(topic->deps, sizeof(*topic->deps)*topic->sdeps);
+			if (!topic->deps)
+				mylog(LOG_ERR, "realloc deps %u failed", topic->sdeps);
+		}
+		topic->deps[topic->ndeps++] = (struct logicdep){
+			.it = it,
+			.root = root,
+			.rpn = rpn,
+			.isnew = rpn_tests_isnew(rpn),
+		};
+		want_topic(topic);
 	}
 }
-#define rpn_ref(rpn)	rpn_add_ref((rpn), +1)
-#define rpn_unref(rpn)	rpn_add_ref((rpn), -1)
-static int rpn_has_ref(struct rpn *rpn, const char *topic)
+
+static void rpn_unref(struct rpn *rpn)
 {
+	struct topic *topic;
+	int j;
+
 	for (; rpn; rpn = rpn->next) {
-		if (rpn->topic && !strcmp(topic, rpn->topic))
-			return 1;
+		topic = rpn->env;
+		if (!topic)
+			continue;
+		rpn->env = NULL;
+		for (j = 0; j < topic->ndeps; ++j) {
+			if (topic->deps[j].rpn == rpn) {
+				/* keep the order, so the deps of 1 item stay together */
+				--topic->ndeps;
+				memmove(topic->deps+j, topic->deps+j+1, (topic->ndeps-j)*sizeof(*topic->deps));
+				queue_subscription(topic);
+				break;
+			}
+		}
 	}
-	return 0;
 }
 
 static int rpn_referred(struct rpn *rpn, void *dat)
@@ -287,6 +685,9 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	/* set write topic */
 	if (suffix == mqtt_setsuffix)
 		asprintf(&it->writetopic, "%s%s", it->topic, mqtt_write_suffix);
+	it->self = get_topic(it->topic, 1);
+	it->self->item = it;
+	want_topic(it->self);
 
 	/* insert in linked list */
 	it->next = items;
@@ -299,6 +700,254 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	return it;
 }
 
+/* evaluation queue:
+ * Incoming messages only queue the dependent logic.
+ * The queue is evaluated after each batch of messages, so logic
+ * with several changed inputs runs only once.
+ * The queue is sorted per level, so that logic which depends
+ * on the output of other logic runs after that other logic.
+ * Levels change when logic is added, so the queue is sorted again
+ * before it is evaluated.
+ */
+#define NLEVELS	32
+static struct {
+	struct item *head, *tail;
+} queue[NLEVELS];
+static int nqueued;
+/* logic that is queued again during a batch */
+static struct item *pending;
+static int levelgen; /* increments when any logic changes */
+static int queuelevelgen; /* levelgen with which the queue was sorted */
+/* the logic that produces a topic */
+static inline struct item *topic_producer(struct topic *topic)
+{
+	return (topic->item && topic->item->logic && !topic->item->writetopic) ?
+		topic->item : NULL;
+}
+/* start at 1, new items have evalgen 0 */
+static int batchgen = 1;
+static int flushing;
+/* topics that changed during this batch */
+static struct topic *newtopics;
+/* topics with a deferred value */
+static struct topic *defertopics;
+
+static int item_level(struct item *it)
+{
+	struct rpn *rpn;
+	struct topic *topic;
+	int level;
+
+	if (it->levelgen == levelgen)
+		return it->level;
+	it->levelgen = levelgen;
+	/* a loop in the logic will see level 0 here */
+	it->level = 0;
+	for (rpn = it->logic; rpn; rpn = rpn->next) {
+		topic = rpn->env;
+		if (!topic || !topic_producer(topic) || topic->item == it)
+			continue;
+		level = item_level(topic->item) + 1;
+		if (level > it->level)
+			it->level = (level < NLEVELS) ? level : NLEVELS-1;
+	}
+	return it->level;
+}
+
+static void queue_level(struct item *it)
+{
+	int level;
+
+	level = item_level(it);
+	it->qnext = NULL;
+	if (queue[level].tail)
+		queue[level].tail->qnext = it;
+	else
+		queue[level].head = it;
+	queue[level].tail = it;
+}
+
+static void queue_logic(struct item *it, int trigger)
+{
+	it->trigger |= trigger;
+	if (it->queued)
+		return;
+	it->queued = 1;
+	++nqueued;
+	if (it->evalgen == batchgen) {
+		/* evaluated during this batch already */
+		it->qnext = pending;
+		pending = it;
+		return;
+	}
+	queue_level(it);
+}
+
+/* sort the queue again when the levels changed */
+static void requeue_levels(void)
+{
+	struct item *list = NULL, **plist = &list, *it;
+	int level;
+
+	if (queuelevelgen == levelgen)
+		return;
+	queuelevelgen = levelgen;
+	/* concatenate all levels, keep the order */
+	for (level = 0; level < NLEVELS; ++level) {
+		if (!queue[level].head)
+			continue;
+		*plist = queue[level].head;
+		plist = &queue[level].tail->qnext;
+		queue[level].head = queue[level].tail = NULL;
+	}
+	while (list) {
+		it = list;
+		list = it->qnext;
+		queue_level(it);
+	}
+}
+
+static void unqueue_logic(struct item *it)
+{
+	struct item **pit, *prev;
+	int level;
+
+	if (!it->queued)
+		return;
+	for (pit = &pending; *pit; pit = &(*pit)->qnext) {
+		if (*pit == it) {
+			*pit = it->qnext;
+			goto done;
+		}
+	}
+	for (level = 0; level < NLEVELS; ++level) {
+		for (prev = NULL, pit = &queue[level].head; *pit; prev = *pit, pit = &(*pit)->qnext) {
+			if (*pit == it) {
+				*pit = it->qnext;
+				if (queue[level].tail == it)
+					queue[level].tail = prev;
+				goto done;
+			}
+		}
+	}
+done:
+	it->queued = 0;
+	--nqueued;
+}
+
+/* the topics of this batch are not new anymore */
+static void clear_newtopics(void)
+{
+	struct topic *topic;
+
+	for (topic = newtopics; topic; topic = topic->newnext)
+		topic->isnew = 0;
+	newtopics = NULL;
+}
+
+static void do_logic(struct item *it);
+static void set_topic_value(struct topic *topic, const char *value, int len, struct item *writer);
+static void flush_logic(void)
+{
+	struct item *it;
+	struct topic *topic;
+	char *value;
+	int level;
+
+	if (flushing || !synced)
+		return;
+	flushing = 1;
+	requeue_levels();
+	for (level = 0; level < NLEVELS;) {
+		it = queue[level].head;
+		if (!it) {
+			++level;
+			continue;
+		}
+		queue[level].head = it->qnext;
+		if (!queue[level].head)
+			queue[level].tail = NULL;
+		it->queued = 0;
+		--nqueued;
+		it->evalgen = batchgen;
+		do_logic(it);
+		/* evaluation may have queued logic on any level */
+		level = 0;
+	}
+	/* end of batch */
+	clear_newtopics();
+	++batchgen;
+	flushing = 0;
+	/* deferred values queue their logic for the next batch,
+	 * only write-through happens during a flush
+	 */
+	while (defertopics) {
+		topic = defertopics;
+		defertopics = topic->defernext;
+		value = topic->deferred;
+		topic->deferred = NULL;
+		set_topic_value(topic, value, strlen(value), topic->item);
+		free(value);
+	}
+	/* move pending logic to the queue, for the next batch */
+	while (pending) {
+		it = pending;
+		pending = it->qnext;
+		it->queued = 0;
+		--nqueued;
+		queue_logic(it, 0);
+	}
+}
+
+static void set_topic_value(struct topic *topic, const char *value, int len, struct item *writer)
+{
+	struct item *it;
+	int j, unchanged;
+
+	unchanged = topic->value && len == strlen(topic->value) &&
+		!memcmp(topic->value, value ?: "", len);
+	if (unchanged) {
+		/* only logic that tests 'isnew' sees a repeated value */
+		for (j = 0; j < topic->ndeps; ++j) {
+			if (topic->deps[j].isnew)
+				break;
+		}
+		if (j >= topic->ndeps)
+			return;
+	}
+	if (topic->isnew && flushing) {
+		/* 2nd value during this flush,
+		 * keep the 1st value for this batch, and defer this one
+		 */
+		if (!topic->deferred) {
+			topic->defernext = defertopics;
+			defertopics = topic;
+		} else
+			free(topic->deferred);
+		topic->deferred = strndup(value ?: "", len);
+		return;
+	} else if (topic->isnew)
+		/* 2nd value during this batch,
+		 * make sure the logic sees the 1st value too
+		 */
+		flush_logic();
+	free(topic->value);
+	topic->value = strndup(value ?: "", len);
+	/* parse once, for all logic that reads it */
+	topic->dvalue = mystrtod(topic->value, NULL);
+	if (!topic->isnew) {
+		topic->isnew = 1;
+		topic->newnext = newtopics;
+		newtopics = topic;
+	}
+	for (j = 0; j < topic->ndeps; ++j) {
+		it = topic->deps[j].it;
+		if (topic->deps[j].root == it->logic && it != writer &&
+				(!unchanged || topic->deps[j].isnew))
+			queue_logic(it, (topic == it->self) ? TRIG_SELF : TRIG_OTHER);
+	}
+}
+
 static void drop_item(struct item *it, struct rpn **prpn)
 {
 	if (*prpn) {
@@ -306,6 +955,10 @@ static void drop_item(struct item *it, struct rpn **prpn)
 		rpn_free_chain(*prpn);
 		*prpn = NULL;
 	}
+	if (!it->logic) {
+		unqueue_logic(it);
+		++levelgen;
+	}
 	if (it->logic || it->onchange)
 		return;
 	/* remove from list */
@@ -313,6 +966,8 @@ static void drop_item(struct item *it, struct rpn **prpn)
 		it->prev->next = it->next;
 	if (it->next)
 		it->next->prev = it->prev;
+	it->self->item = NULL;
+	queue_subscription(it->self);
 	/* free memory */
 	free(it->topic);
 	myfree(it->writetopic);
@@ -320,26 +975,27 @@ static void drop_item(struct item *it, struct rpn **prpn)
 	free(it);
 }
 
-static void do_logic(struct item *it, struct topic *trigger)
+static void do_logic(struct item *it)
 {
-	int ret;
+	int ret, selftrigger;
 	const char *result;
+	struct topic *trigger;
 
+	/* the loop test applies when only its own topic triggered it */
+	selftrigger = it->trigger == TRIG_SELF;
+	it->trigger = 0;
 	lastrpntopic = NULL;
 	rpn_stack_reset(&rpnstack);
-	if (trigger)
-		trigger->isnew = 1;
 	ret = rpn_run(&rpnstack, it->logic);
-	if (trigger)
-		trigger->isnew = 0;
 	if (ret < 0 || !rpnstack.n)
 		/* TODO: alert */
 		return;
 	result = rpnstack.strvalue ?: mydtostr(rpnstack.v[rpnstack.n-1]);
 	/* test if we found something new */
+	trigger = (selftrigger && it->self->isnew) ? it->self : NULL;
 	if (!strcmp(it->lastvalue ?: "", result))
 		return;
-	else if (trigger && !strcmp(trigger->topic, it->topic)) {
+	else if (trigger) {
 		/* This new calculation is triggered by the topic itself: beware loops */
 		if (!strcmp(result, trigger->value ?: ""))
 			/* our result changed to the current value: ok
@@ -356,6 +1012,13 @@ static void do_logic(struct item *it, struct topic *trigger)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", it->writetopic ?: it->topic, mosquitto_strerror(ret));
 		return;
 	}
+	if (!it->writetopic) {
+		/* write through, so the logic that depends on it
+		 * sees the new value in this batch already
+		 */
+		push_echo(it->self, result);
+		set_topic_value(it->self, result, strlen(result), it);
+	}
 	/* save cache */
 save_cache:
 	if (it->lastvalue)
@@ -375,22 +1038,50 @@ void rpn_run_again(void *dat)
 	struct item *it = ((struct rpn *)dat)->dat;
 
 	if (rpn_referred(it->logic, dat))
-		do_logic(it, NULL);
+		queue_logic(it, TRIG_OTHER);
 	else if (rpn_referred(it->onchange, dat))
 		do_onchanged(it);
 }
 
+/* subscribing a pattern again resends its retained messages,
+ * while any newer message arrives not retained
+ */
+static inline int resent(const struct mosquitto_message *msg)
+{
+	return refetching && msg->retain;
+}
+
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
 {
 	struct item *it;
 	struct topic *topic;
 	int ret;
 
-	if (!strcmp(msg->topic, "tools/loglevel")) {
+	if (is_self_sync(msg)) {
+		if (!started) {
+			mylog(LOG_INFO, "retained messages received, start logic");
+			started = 1;
+			sweep = !narrow;
+			/* the retained values are the initial state, not news.
+			 * Otherwise the loop test in do_logic blocks the 1st result
+			 * of all logic whose own topic is retained
+			 */
+			clear_newtopics();
+		}
+		/* the logic is complete now, sort the queue with
+		 * the final levels before the 1st evaluation
+		 */
+		requeue_levels();
+		synced = 1;
+		end_fetch();
+		return;
+	} else if (!strcmp(msg->topic, "tools/loglevel")) {
 		mysetloglevelstr(msg->payload);
 	} else if (test_suffix(msg->topic, mqtt_suffix)) {
 		/* this is a logic set msg */
 		it = get_item(msg->topic, mqtt_suffix, msg->payloadlen);
+		if (it && it->logic && resent(msg))
+			return;
 		if (!it || !msg->payloadlen) {
 			if (it)
 				drop_item(it, &it->logic);
@@ -405,15 +1096,20 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->logic);
 		/* prepare new info */
 		it->logic = rpn_parse(msg->payload, it);
+		if (!it->logic)
+			mylog(LOG_WARNING, "logic for %s rejected", it->topic);
 		rpn_resolve_relative(it->logic, it->topic);
-		rpn_ref(it->logic);
+		rpn_ref(it, it->logic);
+		++levelgen;
 		mylog(LOG_INFO, "new logic for %s", it->topic);
 		/* ready, first run */
-		do_logic(it, NULL);
+		queue_logic(it, TRIG_OTHER);
 		return;
 	} else if (test_suffix(msg->topic, mqtt_setsuffix)) {
 		/* this is a logic set msg */
 		it = get_item(msg->topic, mqtt_setsuffix, msg->payloadlen);
+		if (it && it->logic && resent(msg))
+			return;
 		if (!it || !msg->payloadlen) {
 			if (it)
 				drop_item(it, &it->logic);
@@ -426,14 +1122,19 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->logic);
 		/* prepare new info */
 		it->logic = rpn_parse(msg->payload, it);
+		if (!it->logic)
+			mylog(LOG_WARNING, "setlogic for %s rejected", it->topic);
 		rpn_resolve_relative(it->logic, it->topic);
-		rpn_ref(it->logic);
+		rpn_ref(it, it->logic);
+		++levelgen;
 		mylog(LOG_INFO, "new setlogic for %s", it->topic);
 		/* ready, first run */
-		do_logic(it, NULL);
+		queue_logic(it, TRIG_OTHER);
 		return;
 	} else if (test_suffix(msg->topic, mqtt_onchangesuffix)) {
 		it = get_item(msg->topic, mqtt_onchangesuffix, msg->payloadlen);
+		if (it && it->onchange && resent(msg))
+			return;
 		if (!it || !msg->payloadlen) {
 			if (it)
 				drop_item(it, &it->onchange);
@@ -444,21 +1145,23 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		rpn_free_chain(it->onchange);
 		/* prepare new info */
 		it->onchange = rpn_parse(msg->payload, it);
+		if (!it->onchange)
+			mylog(LOG_WARNING, "onchange for %s rejected", it->topic);
 		rpn_resolve_relative(it->onchange, it->topic);
-		rpn_ref(it->onchange);
+		rpn_ref(it, it->onchange);
 		mylog(LOG_INFO, "new onchange for %s", it->topic);
 		return;
 	}
-	/* find topic */
-	topic = get_topic(msg->topic, msg->payloadlen);
+	/* find topic, cache only used topics once started */
+	topic = get_topic(msg->topic, msg->payloadlen && !started);
+	if (topic && topic->value && resent(msg))
+		return;
 	if (topic) {
-		free(topic->value);
-		topic->value = strndup(msg->payload ?: "", msg->payloadlen);
-		if (topic->ref) {
-			for (it = items; it; it = it->next) {
-				if (rpn_has_ref(it->logic, msg->topic))
-					do_logic(it, topic);
-			}
+		/* our own writes return, they were written through */
+		if (!pop_echo(topic, msg->payload, msg->payloadlen)) {
+			/* someone else wrote, our pending echoes are outdated */
+			flush_echoes(topic);
+			set_topic_value(topic, msg->payload, msg->payloadlen, NULL);
 		}
 	}
 	/* run onchange logic */
@@ -487,7 +1190,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -501,6 +1204,9 @@ int main(int argc, char *argv[])
 	case 'v':
 		++loglevel;
 		break;
+	case 'a':
+		asynclog = 1;
+		break;
 	case 'm':
 		mqtt_host = optarg;
 		str = strrchr(optarg, ':');
@@ -522,6 +1228,17 @@ int main(int argc, char *argv[])
 	case 'w':
 		mqtt_write_suffix = optarg;
 		break;
+	case 'n':
+		narrow = 1;
+		break;
+	case 'l':
+		narrowlevels = strtol(optarg, &str, 0);
+		if (*str || narrowlevels <= 0 || narrowlevels > 64) {
+			fprintf(stderr, "bad levels '%s'\n", optarg);
+			fputs(help_msg, stderr);
+			exit(1);
+		}
+		break;
 
 	default:
 		fprintf(stderr, "unknown option '%c'\n", opt);
@@ -530,9 +1247,13 @@ int main(int argc, char *argv[])
 		exit(1);
 		break;
 	}
+	if (narrow)
+		narrow = narrowlevels;
 
 	myopenlog(NAME, 0, LOG_LOCAL2);
 	myloglevel(loglevel);
+	if (asynclog && myasynclog(1024) < 0)
+		mylog(LOG_ERR, "asynchronous logging: %s", ESTR(errno));
 	setlocale(LC_TIME, "");
 
 	/* MQTT start */
@@ -550,24 +1271,32 @@ int main(int argc, char *argv[])
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
 
-	if (optind >= argc) {
-		ret = mosquitto_subscribe(mosq, NULL, "#", mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe '#': %s", mosquitto_strerror(ret));
-	} else for (; optind < argc; ++optind) {
-		ret = mosquitto_subscribe(mosq, NULL, argv[optind], mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
+	if (optind < argc && narrow) {
+		/* explicit patterns */
+		mylog(LOG_WARNING, "--narrow is ignored with PATTERN '%s'", argv[optind]);
+		narrow = 0;
 	}
+	if (optind >= argc && narrow) {
+		subscribe_suffix(mqtt_suffix);
+		subscribe_suffix(mqtt_setsuffix);
+		subscribe_suffix(mqtt_onchangesuffix);
+		ret = mosquitto_subscribe(mosq, NULL, "tools/loglevel", mqtt_qos);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_subscribe tools/loglevel: %s", mosquitto_strerror(ret));
+	} else if (optind >= argc)
+		subscribe_pattern("#");
+	else for (; optind < argc; ++optind)
+		subscribe_pattern(argv[optind]);
+	/* the self-sync arrives after the retained messages */
+	send_self_sync(mosq, mqtt_qos);
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		flush_logic();
+		/* don't wait when logic is pending for the next batch */
+		evloop_iterate((nqueued && synced) ? 0 : -1);
+		flush_logic();
+		flush_subscriptions();
 	}
 	return 0;
 }
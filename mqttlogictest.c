@@ -0,0 +1,230 @@
+/* scenario tests for mqttlogic:
+ * mqttlogic.c is included, and runs against a fake broker
+ * that only records what is published, and delivers
+ * the self-sync and the echoes when the test asks for it.
+ */
+#define main mqttlogic_main
+#include "mqttlogic.c"
+#undef main
+
+/* fake broker */
+static struct msg {
+	char *topic;
+	char *payload;
+} inflight[256];
+static int ninflight;
+static char published[4096];
+static char subscriptions[4096];
+
+int mosquitto_lib_init(void) { return 0; }
+struct mosquitto *mosquitto_new(const char *id, bool clean, void *obj) { return NULL; }
+int mosquitto_connect(struct mosquitto *m, const char *host, int port, int keepalive) { return 0; }
+int mosquitto_loop_read(struct mosquitto *m, int max_packets) { return 0; }
+int mosquitto_loop_write(struct mosquitto *m, int max_packets) { return 0; }
+int mosquitto_loop_misc(struct mosquitto *m) { return 0; }
+int mosquitto_socket(struct mosquitto *m) { return -1; }
+bool mosquitto_want_write(struct mosquitto *m) { return 0; }
+const char *mosquitto_strerror(int err) { return "fake"; }
+void mosquitto_log_callback_set(struct mosquitto *m, void (*fn)(struct mosquitto *, void *, int, const char *)) {}
+void mosquitto_message_callback_set(struct mosquitto *m, void (*fn)(struct mosquitto *, void *, const struct mosquitto_message *)) {}
+
+int mosquitto_subscribe(struct mosquitto *m, int *mid, const char *sub, int qos)
+{
+	if (!strcmp(sub, "tmp/selfsync"))
+		return 0;
+	sprintf(subscriptions+strlen(subscriptions), "%s+%s", *subscriptions ? " " : "", sub);
+	return 0;
+}
+
+int mosquitto_unsubscribe(struct mosquitto *m, int *mid, const char *sub)
+{
+	sprintf(subscriptions+strlen(subscriptions), "%s-%s", *subscriptions ? " " : "", sub);
+	return 0;
+}
+
+int mosquitto_will_set(struct mosquitto *m, const char *topic, int len, const void *payload, int qos, bool retain)
+{
+	return 0;
+}
+
+int mosquitto_publish(struct mosquitto *m, int *mid, const char *topic, int len, const void *payload, int qos, bool retain)
+{
+	if (strcmp(topic, "tmp/selfsync"))
+		sprintf(published+strlen(published), "%s%s=%.*s", *published ? " " : "", topic, len, (const char *)payload);
+	/* subscribed to '#': all comes back */
+	if (ninflight >= sizeof(inflight)/sizeof(inflight[0]))
+		mylog(LOG_ERR, "too many messages in flight");
+	inflight[ninflight++] = (struct msg){
+		.topic = strdup(topic),
+		.payload = strndup(payload, len),
+	};
+	return 0;
+}
+
+static void broker_msg(const char *topic, const char *payload, int retain)
+{
+	struct mosquitto_message msg = {
+		.topic = (char *)topic,
+		.payload = (void *)payload,
+		.payloadlen = strlen(payload),
+		.retain = retain,
+	};
+
+	my_mqtt_msg(NULL, NULL, &msg);
+}
+
+/* 1 batch of messages, as the main loop does */
+static void batch(void)
+{
+	flush_logic();
+	flush_subscriptions();
+}
+
+/* deliver the messages in flight, return how many */
+static int deliver(void)
+{
+	struct msg cur[sizeof(inflight)/sizeof(inflight[0])];
+	int j, n;
+
+	n = ninflight;
+	memcpy(cur, inflight, n*sizeof(cur[0]));
+	ninflight = 0;
+	for (j = 0; j < n; ++j) {
+		broker_msg(cur[j].topic, cur[j].payload, 0);
+		free(cur[j].topic);
+		free(cur[j].payload);
+	}
+	batch();
+	return n;
+}
+
+static int nerr;
+static void expect(const char *name, const char *exp)
+{
+	if (strcmp(published, exp)) {
+		printf("%s: published '%s', expected '%s'\n", name, published, exp);
+		++nerr;
+	}
+	*published = 0;
+}
+
+static void expect_subs(const char *name, const char *exp)
+{
+	if (strcmp(subscriptions, exp)) {
+		printf("%s: subscribed '%s', expected '%s'\n", name, subscriptions, exp);
+		++nerr;
+	}
+	*subscriptions = 0;
+}
+
+static void start(void)
+{
+	send_self_sync(mosq, mqtt_qos);
+}
+
+/* the logic's own topic is retained with a stale value */
+static void test_stale_retained(void)
+{
+	start();
+	broker_msg("a/logic", "${b}", 1);
+	broker_msg("a", "0", 1);
+	broker_msg("b", "1", 1);
+	batch();
+	/* the self-sync, then the echoes */
+	deliver();
+	expect("stale retained", "a=1");
+	deliver();
+	expect("stale retained echo", "");
+}
+
+/* its own topic and an input change in 1 batch */
+static void test_self_and_input(void)
+{
+	start();
+	broker_msg("x/logic", "${x} ${in} +", 1);
+	broker_msg("x", "0", 1);
+	broker_msg("in", "0", 1);
+	batch();
+	deliver();
+	deliver();
+	expect("self and input init", "x=0");
+	broker_msg("x", "5", 0);
+	broker_msg("in", "1", 0);
+	batch();
+	expect("self and input", "x=6");
+	deliver();
+	/* its own topic alone still is a loop */
+	broker_msg("x", "7", 0);
+	batch();
+	expect("self alone", "");
+}
+
+/* the echoes of 2 writes in a row */
+static void test_echoes(void)
+{
+	start();
+	broker_msg("e/x/logic", "${e/in}", 1);
+	broker_msg("e/z/logic", "${e/x} 10 *", 1);
+	batch();
+	deliver();
+	deliver();
+	*published = 0;
+	broker_msg("e/in", "1", 0);
+	batch();
+	broker_msg("e/in", "2", 0);
+	batch();
+	expect("echoes", "e/x=1 e/z=10 e/x=2 e/z=20");
+	deliver();
+	expect("echoes return", "");
+	/* someone else writes in between */
+	broker_msg("e/in", "3", 0);
+	batch();
+	expect("echoes 3", "e/x=3 e/z=30");
+	broker_msg("e/x", "4", 0);
+	batch();
+	expect("foreign write", "e/z=40");
+	/* our e/x=3 returns after it: the broker holds 3 */
+	deliver();
+	expect("echoes after foreign write", "e/z=30");
+	deliver();
+	expect("echoes settled", "");
+}
+
+/* a new reference fetches via the covering pattern */
+static void test_fetch_covered(void)
+{
+	*subscriptions = 0;
+	broker_msg("f/x/logic", "${f/in} 1 +", 0);
+	batch();
+	expect_subs("fetch covered", "+#");
+	/* the broker resends all retained messages */
+	broker_msg("f/in", "3", 1);
+	broker_msg("x", "0", 1);
+	broker_msg("x/logic", "${x} ${in} +", 1);
+	deliver();
+	expect("fetch covered", "f/x=4");
+	expect_subs("fetch covered end", "");
+	deliver();
+	expect("fetch covered echo", "");
+	/* the resent values were not taken */
+	broker_msg("in", "2", 0);
+	batch();
+	expect("fetch covered resent", "x=9");
+	deliver();
+}
+
+int main(int argc, char *argv[])
+{
+	myopenlog("mqttlogictest", 0, LOG_LOCAL2);
+	myloglevel(argc > 1 ? LOG_DEBUG : LOG_ERR);
+	/* like mqttlogic without PATTERN */
+	subscribe_pattern("#");
+
+	test_stale_retained();
+	test_self_and_input();
+	test_echoes();
+	test_fetch_covered();
+
+	printf("%i errors\n", nerr);
+	return !!nerr;
+}
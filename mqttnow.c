@@ -17,6 +17,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttnow"
 #ifndef VERSION
@@ -136,6 +137,8 @@ static struct item *get_item(const char *topic, int create)
 }
 
 static void sendnow(void *dat);
+static struct libt_timer *nowtimer;
+
 static void drop_item(struct item *it)
 {
 	/* remove from list */
@@ -143,7 +146,6 @@ static void drop_item(struct item *it)
 		it->prev->next = it->next;
 	if (it->next)
 		it->next->prev = it->prev;
-	libt_remove_timeout(sendnow, it);
 	/* free memory */
 	free(it->topic);
 	if (it->fmt)
@@ -225,12 +227,11 @@ static void sendnow(void *dat)
 			free(it->lastvalue);
 		it->lastvalue = strdup(str);
 	}
-	libt_repeat_timeout(1, sendnow, dat);
 }
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -298,6 +299,11 @@ int main(int argc, char *argv[])
 	}
 
 	sendnow(NULL);
+	nowtimer = libt_timer_new(sendnow, NULL);
+	libt_timer_slack(nowtimer, 0.1);
+	libt_timer_periodic(nowtimer, 1);
+
+	evloop_init(mosq, mqtt_keepalive);
 	while (!sigterm || items) {
 		if (sigterm == 1) {
 			struct item *it;
@@ -308,13 +314,7 @@ int main(int argc, char *argv[])
 			for (it = items; it; it = it->next)
 				mosquitto_publish(mosq, NULL, it->topic, 0, NULL, mqtt_qos, 1);
 		}
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
@@ -18,6 +18,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttpoort"
 #ifndef VERSION
@@ -42,6 +43,7 @@ static const char help_msg[] =
 	" -s, --suffix=STR	Give MQTT topic suffix for configuration (default '/poortcfg')\n"
 	" -S, --nosuffix	Write control topic without suffix\n"
 	" -k, --homekit=SUFFIX[,WRSUFFIX]	Report/accept 'homekit' status to this suffix\n"
+	" -z, --virtual		Run on the shared virtual clock of mqttvclock, for simulations\n"
 	"\n"
 	"Paramteres\n"
 	" PATTERN	A pattern to subscribe for\n"
@@ -57,6 +59,7 @@ static struct option long_opts[] = {
 	{ "suffix", required_argument, NULL, 's', },
 	{ "nosuffix", no_argument, NULL, 'S', },
 	{ "homekit", required_argument, NULL, 'k', },
+	{ "virtual", no_argument, NULL, 'z', },
 
 	{ },
 };
@@ -64,7 +67,7 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:s:Sk:";
+static const char optstring[] = "Vv?m:s:Sk:z";
 
 /* logging */
 static int loglevel = LOG_WARNING;
@@ -793,6 +796,8 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 	int ret;
 	struct item *it;
 
+	if (evloop_clock_msg(msg))
+		return;
 	if (!strcmp(msg->topic, "tools/loglevel")) {
 		mysetloglevelstr(msg->payload);
 	} else if (test_suffix(msg->topic, mqtt_suffix)) {
@@ -1009,7 +1014,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -1023,6 +1028,9 @@ int main(int argc, char *argv[])
 	case 'v':
 		++loglevel;
 		break;
+	case 'z':
+		evloop_virtual_clock();
+		break;
 	case 'm':
 		mqtt_host = optarg;
 		str = strrchr(optarg, ':');
@@ -1083,14 +1091,9 @@ int main(int argc, char *argv[])
 			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 	}
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
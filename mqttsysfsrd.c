@@ -18,7 +18,9 @@
 #include <mosquitto.h>
 
 #include "lib/libt.h"
+#include "lib/libe.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttsysfsrd"
 #ifndef VERSION
@@ -88,9 +90,16 @@ struct item {
 	char *topic;
 	int topiclen;
 	char *sysfs;
+	int fd;
+	int flags;
+		#define FL_READING	0x01 /* read in progress */
+		#define FL_DROPPED	0x02 /* free when read completes */
+		#define FL_REOPEN	0x04 /* sysfs path changed during read */
+	char strvalue[128];
 	long lastvalue;
 	double mul;
 	double samplerate;
+	struct libt_timer *timer;
 
 	struct map *map;
 	int nmap, mapsize;
@@ -119,6 +128,7 @@ static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const
 	}
 }
 
+static void pub_it(void *dat);
 static struct item *get_item(const char *topic, const char *suffix, int create)
 {
 	struct item *it;
@@ -142,6 +152,8 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	memset(it, 0, sizeof(*it));
 	it->topic = strndup(topic, len);
 	it->topiclen = len;
+	it->fd = -1;
+	it->timer = libt_timer_new(pub_it, it);
 
 	/* insert in linked list */
 	it->next = items;
@@ -179,7 +191,17 @@ static void add_map(struct item *it, double v, const char *s)
 	++it->nmap;
 }
 
-static void pub_it(void *dat);
+static void free_item(struct item *it)
+{
+	if (it->fd >= 0)
+		close(it->fd);
+	drop_map(it);
+	free(it->topic);
+	if (it->sysfs)
+		free(it->sysfs);
+	free(it);
+}
+
 static void drop_item(struct item *it)
 {
 	/* remove from list */
@@ -189,13 +211,14 @@ static void drop_item(struct item *it)
 		it->next->prev = it->prev;
 	/* clean mqtt topic */
 	mosquitto_publish(mosq, NULL, it->topic, 0, NULL, 0, 1);
-	libt_remove_timeout(pub_it, it);
-	/* free memory */
-	drop_map(it);
-	free(it->topic);
-	if (it->sysfs)
-		free(it->sysfs);
-	free(it);
+	libt_timer_free(it->timer);
+	it->timer = NULL;
+	if (it->flags & FL_READING) {
+		/* the read still owns the buffer */
+		it->flags |= FL_DROPPED;
+		return;
+	}
+	free_item(it);
 }
 
 static void parse_map(struct item *it)
@@ -216,24 +239,33 @@ static void parse_map(struct item *it)
 }
 
 /* read hw */
-static void pub_it(void *dat)
+static void sysfs_read_done(int fd, void *dat)
 {
 	struct item *it = dat;
-	static char strvalue[128];
-	int fd, ret, j;
+	char *strvalue = it->strvalue;
+	int ret, j;
 	long value;
 
-	fd = open(it->sysfs, O_RDONLY);
-	if (fd < 0) {
-		mylog(LOG_WARNING, "open %s failed: %s", it->sysfs, ESTR(errno));
-		goto fail_open;
+	it->flags &= ~FL_READING;
+	if (it->flags & FL_DROPPED) {
+		free_item(it);
+		return;
+	}
+	if (it->flags & FL_REOPEN) {
+		/* this value came from the old path */
+		it->flags &= ~FL_REOPEN;
+		close(it->fd);
+		it->fd = -1;
+		pub_it(it);
+		return;
 	}
-	ret = read(fd, strvalue, sizeof(strvalue)-1);
+	ret = libe_result();
 	if (ret < 0) {
-		mylog(LOG_WARNING, "read %s failed: %s", it->sysfs, ESTR(errno));
-		goto fail_read;
+		mylog(LOG_WARNING, "read %s failed: %s", it->sysfs, ESTR(-ret));
+		/* remove, I cannot handle it */
+		drop_item(it);
+		return;
 	}
-	close(fd);
 	/* null-terminate value */
 	strvalue[ret] = 0;
 
@@ -260,11 +292,30 @@ static void pub_it(void *dat)
 		else
 			it->lastvalue = value;
 	}
-	libt_repeat_timeout(it->samplerate, pub_it, dat);
+}
+
+static void pub_it(void *dat)
+{
+	struct item *it = dat;
+
+	if (it->fd < 0) {
+		/* keep the attribute open, sysfs regenerates it at offset 0 */
+		it->fd = open(it->sysfs, O_RDONLY | O_CLOEXEC);
+		if (it->fd < 0) {
+			mylog(LOG_WARNING, "open %s failed: %s", it->sysfs, ESTR(errno));
+			goto failed;
+		}
+	}
+	if (!(it->flags & FL_READING)) {
+		/* reads of all items due now go out in 1 batch */
+		if (libe_pread(it->fd, it->strvalue, sizeof(it->strvalue)-1, 0, sysfs_read_done, it) < 0) {
+			mylog(LOG_WARNING, "read %s failed: %s", it->sysfs, ESTR(errno));
+			goto failed;
+		}
+		it->flags |= FL_READING;
+	}
 	return;
-fail_read:
-	close(fd);
-fail_open:
+failed:
 	/* remove, I cannot handle it */
 	drop_item(it);
 }
@@ -329,6 +380,12 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		if (it->sysfs)
 			free(it->sysfs);
 		it->sysfs = strdup(value ?: "");
+		if (it->flags & FL_READING)
+			it->flags |= FL_REOPEN;
+		else if (it->fd >= 0) {
+			close(it->fd);
+			it->fd = -1;
+		}
 
 
 		for (;;) {
@@ -354,13 +411,16 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			for (j = 0; j < it->nmap; ++j)
 				mylog(LOG_DEBUG, "	%s=%s", it->map[j].s, mydtostr(it->map[j].v));
 		}
+		/* allow 10% jitter, to share wakeups */
+		libt_timer_slack(it->timer, it->samplerate/10);
+		libt_timer_periodic(it->timer, it->samplerate);
 		pub_it(it);
 	}
 }
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -423,14 +483,9 @@ int main(int argc, char *argv[])
 			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 	}
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
@@ -18,6 +18,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "mqttteleruptor"
 #ifndef VERSION
@@ -42,6 +43,7 @@ static const char help_msg[] =
 	" -s, --suffix=STR	Give MQTT topic suffix for configuration (default '/teleruptorcfg')\n"
 	" -w, --write=STR	Give MQTT topic suffix for writing the topic (default /set)\n"
 	" -S, --nosuffix	Write control topic without suffix\n"
+	" -z, --virtual		Run on the shared virtual clock of mqttvclock, for simulations\n"
 	"\n"
 	"Paramteres\n"
 	" PATTERN	A pattern to subscribe for\n"
@@ -57,6 +59,7 @@ static struct option long_opts[] = {
 	{ "suffix", required_argument, NULL, 's', },
 	{ "write", required_argument, NULL, 'w', },
 	{ "nosuffix", no_argument, NULL, 'S', },
+	{ "virtual", no_argument, NULL, 'z', },
 
 	{ },
 };
@@ -64,7 +67,7 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:s:w:S";
+static const char optstring[] = "Vv?m:s:w:Sz";
 
 /* logging */
 static int loglevel = LOG_WARNING;
@@ -106,6 +109,8 @@ struct item {
 	int currctlval;
 	/* # retries passed */
 	int nretry;
+	struct libt_timer *resettimer;
+	struct libt_timer *idletimer;
 };
 
 struct item *items;
@@ -164,6 +169,8 @@ static struct item *get_item_by_state(const char *topic)
 	return NULL;
 }
 
+static void idle_teleruptor(void *dat);
+static void reset_teleruptor(void *dat);
 static struct item *get_item(const char *topic, const char *suffix, int create)
 {
 	struct item *it;
@@ -186,6 +193,8 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	it = malloc(sizeof(*it));
 	memset(it, 0, sizeof(*it));
 	it->reqval = it->currval = it->currctlval = -1; /* mark invalid */
+	it->resettimer = libt_timer_new(reset_teleruptor, it);
+	it->idletimer = libt_timer_new(idle_teleruptor, it);
 	it->topic = strndup(topic, len);
 	it->topiclen = len;
 	if (mqtt_write_suffix)
@@ -207,9 +216,7 @@ static struct item *get_item(const char *topic, const char *suffix, int create)
 	return it;
 }
 
-static void idle_teleruptor(void *dat);
 static void set_teleruptor(void *dat);
-static void reset_teleruptor(void *dat);
 
 static void drop_item(struct item *it)
 {
@@ -230,11 +237,10 @@ static void drop_item(struct item *it)
 	free(it->ctltopic);
 	myfree(it->ctlwrtopic);
 	free(it->statetopic);
-	free(it);
 	/* free timers */
-	libt_remove_timeout(set_teleruptor, it);
-	libt_remove_timeout(reset_teleruptor, it);
-	libt_remove_timeout(idle_teleruptor, it);
+	libt_timer_free(it->resettimer);
+	libt_timer_free(it->idletimer);
+	free(it);
 }
 
 /* timer callbacks */
@@ -269,7 +275,7 @@ static void reset_teleruptor(void *dat)
 	if (ret < 0)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", it->ctlwrtopic ?: it->ctltopic, mosquitto_strerror(ret));
 	it->ctlval = 2;
-	libt_add_timeout(0.5, idle_teleruptor, it);
+	libt_timer_add(it->idletimer, 0.5);
 }
 
 static void set_teleruptor(void *dat)
@@ -286,7 +292,7 @@ static void set_teleruptor(void *dat)
 	if (ret < 0)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", it->ctlwrtopic ?: it->ctltopic, mosquitto_strerror(ret));
 	it->ctlval = 1;
-	libt_add_timeout(0.5, reset_teleruptor, it);
+	libt_timer_add(it->resettimer, 0.5);
 }
 
 static void setvalue(struct item *it, int newvalue)
@@ -305,6 +311,8 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 	int ret;
 	struct item *it;
 
+	if (evloop_clock_msg(msg))
+		return;
 	if (!strcmp(msg->topic, "tools/loglevel")) {
 		mysetloglevelstr(msg->payload);
 	} else if (test_suffix(msg->topic, mqtt_suffix)) {
@@ -355,9 +363,8 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			}
 			it->ctlval = 0;
 			it->nretry = 0;
-			libt_remove_timeout(set_teleruptor, it);
-			libt_remove_timeout(reset_teleruptor, it);
-			libt_remove_timeout(idle_teleruptor, it);
+			libt_timer_cancel(it->resettimer);
+			libt_timer_cancel(it->idletimer);
 		}
 		setvalue(it, it->reqval);
 		/* finalize */
@@ -394,7 +401,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -408,6 +415,9 @@ int main(int argc, char *argv[])
 	case 'v':
 		++loglevel;
 		break;
+	case 'z':
+		evloop_virtual_clock();
+		break;
 	case 'm':
 		mqtt_host = optarg;
 		str = strrchr(optarg, ':');
@@ -464,14 +474,9 @@ int main(int argc, char *argv[])
 			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
 	}
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }
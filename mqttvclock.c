@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+#include <mosquitto.h>
+
+#include "lib/libt.h"
+#include "common.h"
+#include "evloop.h"
+
+#define NAME "mqttvclock"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+/* program options */
+static const char help_msg[] =
+	NAME ": drive a shared virtual clock for simulations\n"
+	"usage:	" NAME " [OPTIONS ...] PEERS\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
+	"\n"
+	"Paramteres\n"
+	" PEERS		The number of programs that run with --virtual\n"
+	"\n"
+	"The time moves to the earliest timeout of all peers\n"
+	"once all peers are idle, and stays when no timeout is scheduled\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "mqtt", required_argument, NULL, 'm', },
+
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?m:";
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* signal handler */
+static volatile int sigterm;
+
+/* MQTT parameters */
+static const char *mqtt_host = "localhost";
+static int mqtt_port = 1883;
+static int mqtt_keepalive = 10;
+static int mqtt_qos = 1;
+
+/* state */
+static struct mosquitto *mosq;
+static int npeers;
+
+/* the current round */
+static double now;
+static int nrounds;
+static char roundid[32];
+static int inround;
+static int nreports;
+static int busy;
+static double next;
+
+/* signalling */
+static void onsigterm(int signr)
+{
+	sigterm = 1;
+}
+
+/* MQTT iface */
+static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const char *str)
+{
+	static const int logpri_map[] = {
+		MOSQ_LOG_ERR, LOG_ERR,
+		MOSQ_LOG_WARNING, LOG_WARNING,
+		MOSQ_LOG_NOTICE, LOG_NOTICE,
+		MOSQ_LOG_INFO, LOG_INFO,
+		MOSQ_LOG_DEBUG, LOG_DEBUG,
+		0,
+	};
+	int j;
+
+	for (j = 0; logpri_map[j]; j += 2) {
+		if (level & logpri_map[j]) {
+			mylog(logpri_map[j+1], "[mosquitto] %s", str);
+			return;
+		}
+	}
+}
+
+/* ask all peers to report at <now> */
+static void start_round(void)
+{
+	int ret;
+	char buf[64];
+
+	/* the pid keeps the rounds of a previous run apart */
+	sprintf(roundid, "%i.%i", getpid(), ++nrounds);
+	/* exact, like the peers report their timeouts */
+	sprintf(buf, "%s %.17g", roundid, now);
+	ret = mosquitto_publish(mosq, NULL, EVLOOP_CLOCK_TOPIC, strlen(buf), buf, mqtt_qos, 1);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s: %s", EVLOOP_CLOCK_TOPIC, mosquitto_strerror(ret));
+	mylog(LOG_DEBUG, "round %s at %.3lf", roundid, now);
+	inround = 1;
+	nreports = 0;
+	busy = 0;
+	next = -1;
+}
+
+static void end_round(void)
+{
+	inround = 0;
+	if (busy)
+		/* messages may still be underway, ask again */
+		start_round();
+	else if (next >= 0) {
+		/* all peers are idle, move to the first timeout */
+		if (next > now)
+			now = next;
+		start_round();
+	} else
+		mylog(LOG_INFO, "all idle at %.3lf", now);
+}
+
+static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
+{
+	char *id, *str;
+	int peerbusy;
+	double peernext;
+
+	if (!strcmp(msg->topic, "tools/loglevel")) {
+		mysetloglevelstr(msg->payload);
+		return;
+	}
+	if (!strcmp(msg->topic, EVLOOP_CLOCK_TOPIC)) {
+		if (sigterm && !msg->payloadlen)
+			/* our clock is removed */
+			sigterm = 3;
+		return;
+	}
+	if (strcmp(msg->topic, EVLOOP_CLOCK_TOPIC "/idle") || !msg->payloadlen || sigterm)
+		return;
+	/* "<round> <busy> <next timeout>" */
+	id = strtok(msg->payload, " ");
+	str = strtok(NULL, " ");
+	peerbusy = strtol(str ?: "0", NULL, 0);
+	str = strtok(NULL, " ");
+	peernext = strtod(str ?: "-1", NULL);
+
+	if (!strcmp(id, "-")) {
+		/* a peer worked outside any round */
+		if (inround)
+			busy = 1;
+		else
+			start_round();
+		return;
+	}
+	if (!inround || strcmp(id, roundid))
+		/* an old round */
+		return;
+	busy |= peerbusy;
+	if (peernext >= 0 && (next < 0 || peernext < next))
+		next = peernext;
+	if (++nreports >= npeers)
+		end_round();
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret;
+	char *str;
+	char mqtt_name[32];
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'm':
+		mqtt_host = optarg;
+		str = strrchr(optarg, ':');
+		if (str > mqtt_host && *(str-1) != ']') {
+			/* TCP port provided */
+			*str = 0;
+			mqtt_port = strtoul(str+1, NULL, 10);
+		}
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'\n", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+
+	if (optind + 1 != argc || (npeers = strtoul(argv[optind], &str, 0)) <= 0 || *str) {
+		fprintf(stderr, "no number of peers found\n");
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+
+	myopenlog(NAME, 0, LOG_LOCAL2);
+	myloglevel(loglevel);
+	signal(SIGINT, onsigterm);
+	signal(SIGTERM, onsigterm);
+
+	/* MQTT start */
+	mosquitto_lib_init();
+	sprintf(mqtt_name, "%s-%i", NAME, getpid());
+	mosq = mosquitto_new(mqtt_name, true, 0);
+	if (!mosq)
+		mylog(LOG_ERR, "mosquitto_new failed: %s", ESTR(errno));
+
+	mosquitto_log_callback_set(mosq, my_mqtt_log);
+	mosquitto_message_callback_set(mosq, my_mqtt_msg);
+
+	ret = mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
+
+	ret = mosquitto_subscribe(mosq, NULL, EVLOOP_CLOCK_TOPIC "/#", mqtt_qos);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_subscribe '%s/#': %s", EVLOOP_CLOCK_TOPIC, mosquitto_strerror(ret));
+	ret = mosquitto_subscribe(mosq, NULL, "tools/loglevel", mqtt_qos);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_subscribe 'tools/loglevel': %s", mosquitto_strerror(ret));
+
+	/* start at the real time, like the peers did */
+	now = libt_now();
+	start_round();
+
+	evloop_init(mosq, mqtt_keepalive);
+	while (sigterm < 3) {
+		if (sigterm == 1) {
+			/* mark as cleared */
+			sigterm = 2;
+			/* don't leave a stale clock for the next run */
+			mosquitto_publish(mosq, NULL, EVLOOP_CLOCK_TOPIC, 0, NULL, mqtt_qos, 1);
+		}
+		evloop_iterate(-1);
+	}
+	return 0;
+}
@@ -1,5 +1,7 @@
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +18,75 @@
 
 /* placeholder for quitting */
 #define QUIT	((struct rpn *)0xdeadbeef)
+
+/* compiled form:
+ * rpn_parse_done() lowers the linked list into 1 contiguous array
+ * of fixed-size instructions. if/else/fi become relative jumps.
+ * The list elements remain, they hold the per-token state
+ * (cookie, timers, topic) and still serve as API towards the application.
+ */
+enum {
+	OP_CALL = 0, /* call rpn->run */
+	OP_CONST,
+	OP_STRCONST,
+	OP_ENV,
+	OP_WRITEENV,
+
+	OP_PLUS,
+	OP_MINUS,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_POW,
+	OP_NEG,
+
+	OP_BITAND,
+	OP_BITOR,
+	OP_BITXOR,
+	OP_BITINV,
+
+	OP_BOOLAND,
+	OP_BOOLOR,
+	OP_BOOLNOT,
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_GT,
+
+	OP_DUP,
+	OP_SWAP,
+	OP_IFTHENELSE,
+
+	/* superinstructions */
+	OP_ENVLTC, /* ${topic} CONST < */
+	OP_ENVGTC, /* ${topic} CONST > */
+	OP_ENVEQC, /* ${topic} CONST == */
+	OP_ENVNEC, /* ${topic} CONST != */
+	OP_ENVENVAND, /* ${topic} ${topic2} && */
+	OP_ENVENVOR, /* ${topic} ${topic2} || */
+
+	OP_IF, /* jump when false */
+	OP_ELSE, /* jump always */
+	OP_FI, /* not emitted */
+	OP_QUIT,
+};
+
+struct rpn_insn {
+	int op;
+	int jump; /* relative to the next instruction */
+	union {
+		double value; /* immediate */
+		struct rpn *rpn2; /* 2nd token of OP_ENVENV* */
+	};
+	struct rpn *rpn; /* originating token */
+};
+
+struct rpn_code {
+	int n;
+	int maxdepth; /* verified maximum stack depth */
+	struct rpn_insn insn[];
+};
+
 /* manage */
 static struct rpn *rpn_create(void)
 {
@@ -36,6 +107,8 @@ static void rpn_free(struct rpn *rpn)
 		free(rpn->strvalue);
 	if (rpn->timeout)
 		libt_remove_timeout(rpn->timeout, rpn);
+	if (rpn->code)
+		free(rpn->code);
 	free(rpn);
 }
 
@@ -341,6 +414,12 @@ static void rpn_push(struct stack *st, double value)
 	st->v[st->n++] = value;
 }
 
+/* push on a stack that is known to be large enough */
+static inline void rpn_push_fast(struct stack *st, double value)
+{
+	st->v[st->n++] = value;
+}
+
 static int rpn_do_const(struct stack *st, struct rpn *me)
 {
 	rpn_set_strvalue(st, me->strvalue);
@@ -350,15 +429,18 @@ static int rpn_do_const(struct stack *st, struct rpn *me)
 
 static int rpn_do_strconst(struct stack *st, struct rpn *me)
 {
+	/* me->value is parsed already */
 	rpn_set_strvalue(st, me->strvalue);
-	rpn_push(st, mystrtod(st->strvalue ?: "nan", NULL));
+	rpn_push(st, me->value);
 	return 0;
 }
 
 static int rpn_do_env(struct stack *st, struct rpn *me)
 {
-	rpn_set_strvalue(st, rpn_lookup_env(me->topic, me));
-	rpn_push(st, mystrtod(st->strvalue ?: "nan", NULL));
+	double value;
+
+	rpn_set_strvalue(st, rpn_lookup_env(me->topic, me, &value));
+	rpn_push(st, value);
 	return 0;
 }
 
@@ -614,7 +696,8 @@ static int rpn_do_wakeup(struct stack *st, struct rpn *me)
 	time(&t);
 
 	next = t - t % align + align;
-	libt_add_timeout(next - t, rpn_run_again, me);
+	/* share the wakeup with other scripts */
+	libt_add_timeout_slack(next - t, 0.1, rpn_run_again, me);
 	me->timeout = rpn_run_again;
 
 	st->n -= 1;
@@ -657,13 +740,17 @@ static int rpn_do_uptime(struct stack *st, struct rpn *me)
 	fd = open("/proc/uptime", O_RDONLY);
 	if (fd < 0)
 		return -errno;
-	ret = read(fd, buf, sizeof(buf));
-	if (ret > 0) {
-		buf[ret] = 0;
-		rpn_push(st, strtoul(buf, 0, 0));
+	ret = read(fd, buf, sizeof(buf)-1);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
 	}
 	close(fd);
-	return ret;
+	/* always push, the verifier counts on it */
+	buf[ret] = 0;
+	rpn_push(st, strtoul(buf, 0, 0));
+	return 0;
 }
 
 static int rpn_do_strftime(struct stack *st, struct rpn *me)
@@ -728,56 +815,675 @@ static int rpn_do_fi(struct stack *st, struct rpn *me)
 	return 0;
 }
 
-static void rpn_find_fi_else(struct rpn *rpn,
-		struct rpn **pelse, struct rpn **pfi)
+static int rpn_do_quit(struct stack *st, struct rpn *me)
+{
+	st->jumpto = QUIT;
+	/* real quit is done in rpn_run */
+	st->strvalueset = 1;
+	return 0;
+}
+
+/* parser */
+static struct lookup {
+	const char *str;
+	int (*run)(struct stack *, struct rpn *);
+	int op; /* opcode for the compiled form, 0 means OP_CALL */
+	int pop, push; /* stack effect of OP_CALL */
+} const lookups[] = {
+	{ "+", rpn_do_plus, OP_PLUS, },
+	{ "-", rpn_do_minus, OP_MINUS, },
+	{ "*", rpn_do_mul, OP_MUL, },
+	{ "/", rpn_do_div, OP_DIV, },
+	{ "%", rpn_do_mod, OP_MOD, },
+	{ "**", rpn_do_pow, OP_POW, },
+	{ "neg", rpn_do_negative, OP_NEG, },
+
+	{ "&", rpn_do_bitand, OP_BITAND, },
+	{ "|", rpn_do_bitor, OP_BITOR, },
+	{ "^", rpn_do_bitxor, OP_BITXOR, },
+	{ "~", rpn_do_bitinv, OP_BITINV, },
+
+	{ "&&", rpn_do_booland, OP_BOOLAND, },
+	{ "||", rpn_do_boolor, OP_BOOLOR, },
+	{ "!", rpn_do_boolnot, OP_BOOLNOT, },
+	{ "not", rpn_do_boolnot, OP_BOOLNOT, },
+	{ "==", rpn_do_intequal, OP_EQ, },
+	{ "!=", rpn_do_intnotequal, OP_NE, },
+
+	{ "<", rpn_do_lt, OP_LT, },
+	{ ">", rpn_do_gt, OP_GT, },
+
+	{ "dup", rpn_do_dup, OP_DUP, },
+	{ "swap", rpn_do_swap, OP_SWAP, },
+	{ "?:", rpn_do_ifthenelse, OP_IFTHENELSE, },
+
+	{ "limit", rpn_do_limit, .pop = 3, .push = 1, },
+	{ "inrange", rpn_do_inrange, .pop = 3, .push = 1, },
+	{ "category", rpn_do_category, .pop = 2, .push = 1, },
+	{ "hyst1", rpn_do_hyst1, .pop = 3, .push = 1, },
+	{ "hyst2", rpn_do_hyst2, .pop = 3, .push = 1, },
+	{ "hyst", rpn_do_hyst2, .pop = 3, .push = 1, },
+
+	{ "ondelay", rpn_do_ondelay, .pop = 2, .push = 1, },
+	{ "offdelay", rpn_do_offdelay, .pop = 2, .push = 1, },
+	{ "afterdelay", rpn_do_afterdelay, .pop = 2, .push = 1, },
+	{ "debounce", rpn_do_debounce, .pop = 2, .push = 1, },
+	{ "autoreset", rpn_do_autoreset, .pop = 2, .push = 1, },
+
+	{ "isnew", rpn_do_isnew, .pop = 1, .push = 1, },
+	{ "edge", rpn_do_edge, .pop = 1, .push = 1, },
+	{ "rising", rpn_do_rising, .pop = 1, .push = 1, },
+	{ "falling", rpn_do_falling, .pop = 1, .push = 1, },
+	{ "changed", rpn_do_edge, .pop = 1, .push = 1, },
+	{ "pushed", rpn_do_rising, .pop = 1, .push = 1, },
+
+	{ "wakeup", rpn_do_wakeup, .pop = 1, .push = 0, },
+	{ "timeofday", rpn_do_timeofday, .pop = 0, .push = 1, },
+	{ "dayofweek", rpn_do_dayofweek, .pop = 0, .push = 1, },
+	{ "abstime", rpn_do_abstime, .pop = 0, .push = 1, },
+	{ "uptime", rpn_do_uptime, .pop = 0, .push = 1, },
+	{ "strftime", rpn_do_strftime, .pop = 2, .push = 1, },
+
+	{ "sun", rpn_do_sun, .pop = 2, .push = 1, },
+
+	{ "if", rpn_do_if, OP_IF, },
+	{ "else", rpn_do_else, OP_ELSE, },
+	{ "fi", rpn_do_fi, OP_FI, },
+	{ "quit", rpn_do_quit, OP_QUIT, },
+	{ "", },
+};
+
+static struct constant {
+	const char *name;
+	double value;
+} const constants[] = {
+	{ "pi", M_PI, },
+	{ "e", M_E, },
+	{ "", NAN, },
+};
+
+/* hash tables of operators & constants by name,
+ * and of operators by function.
+ * built once, read-only afterwards
+ */
+#define NAMEHASH_SIZE	512 /* power of 2, at least 2x the names */
+static struct namehash {
+	const char *name;
+	int len;
+	const struct lookup *lookup;
+	const struct constant *constant;
+} namehash[NAMEHASH_SIZE];
+static const struct lookup *runhash[NAMEHASH_SIZE];
+static pthread_once_t namehash_once = PTHREAD_ONCE_INIT;
+
+static unsigned int namehash_fn(const char *str, int len)
+{
+	unsigned int hash = 2166136261u;
+
+	/* FNV-1a */
+	for (; len > 0; --len, ++str)
+		hash = (hash ^ *(unsigned char *)str) * 16777619u;
+	return hash & (NAMEHASH_SIZE-1);
+}
+
+static struct namehash *namehash_find(const char *str, int len)
+{
+	struct namehash *ent;
+	unsigned int idx;
+
+	for (idx = namehash_fn(str, len); ; idx = (idx+1) & (NAMEHASH_SIZE-1)) {
+		ent = &namehash[idx];
+		if (!ent->name || (ent->len == len && !memcmp(ent->name, str, len)))
+			return ent;
+	}
+}
+
+static void namehash_add(const char *name, const struct lookup *lookup,
+		const struct constant *constant)
 {
-	int nested = 0;
+	struct namehash *ent;
 
-	*pelse = *pfi = NULL;
-	for (rpn = rpn->next; rpn; rpn = rpn->next) {
-		if (rpn->run == rpn_do_if) {
-			++nested;
+	ent = namehash_find(name, strlen(name));
+	if (ent->name)
+		/* the first definition wins */
+		return;
+	*ent = (struct namehash){
+		.name = name,
+		.len = strlen(name),
+		.lookup = lookup,
+		.constant = constant,
+	};
+}
+
+static unsigned int runhash_fn(int (*run)(struct stack *, struct rpn *))
+{
+	return (((unsigned long)run >> 4) * 2654435761u >> 7) & (NAMEHASH_SIZE-1);
+}
+
+static void namehash_init(void)
+{
+	const struct lookup *lookup;
+	const struct constant *lp;
+	unsigned int idx;
+	int n = 0;
 
-		} else if (rpn->run == rpn_do_fi) {
-			if (!nested) {
-				*pfi = rpn;
-				return;
+	for (lookup = lookups; lookup->str[0]; ++lookup, ++n) {
+		namehash_add(lookup->str, lookup, NULL);
+		for (idx = runhash_fn(lookup->run); runhash[idx]; idx = (idx+1) & (NAMEHASH_SIZE-1)) {
+			if (runhash[idx]->run == lookup->run)
+				break;
+		}
+		/* the first definition wins */
+		if (!runhash[idx])
+			runhash[idx] = lookup;
+	}
+	for (lp = constants; *lp->name; ++lp, ++n)
+		namehash_add(lp->name, NULL, lp);
+	if (n*2 > NAMEHASH_SIZE)
+		mylog(LOG_ERR, "NAMEHASH_SIZE %i too small for %i names", NAMEHASH_SIZE, n);
+}
+
+static const struct namehash *do_lookup(const char *tok, int len)
+{
+	const struct namehash *ent;
+
+	pthread_once(&namehash_once, namehash_init);
+	ent = namehash_find(tok, len);
+	return ent->name ? ent : NULL;
+}
+
+/* find the operator of a token, or NULL */
+static const struct lookup *do_lookup_run(int (*run)(struct stack *, struct rpn *))
+{
+	unsigned int idx;
+
+	pthread_once(&namehash_once, namehash_init);
+	for (idx = runhash_fn(run); runhash[idx]; idx = (idx+1) & (NAMEHASH_SIZE-1)) {
+		if (runhash[idx]->run == run)
+			return runhash[idx];
+	}
+	return NULL;
+}
+
+/* compiler */
+static int rpn_opcode(const struct rpn *rpn)
+{
+	const struct lookup *lookup;
+
+	if (rpn->run == rpn_do_const)
+		return OP_CONST;
+	else if (rpn->run == rpn_do_strconst)
+		return OP_STRCONST;
+	else if (rpn->run == rpn_do_env)
+		return OP_ENV;
+	else if (rpn->run == rpn_do_writeenv)
+		return OP_WRITEENV;
+	lookup = do_lookup_run(rpn->run);
+	return lookup ? lookup->op : OP_CALL;
+}
+
+/* open if/else block during compilation */
+struct rpn_block {
+	int cond; /* index of the 'if' instruction, or -1 */
+	int haselse;
+	int jumps; /* chain of 'else' instructions to fixup on 'fi' */
+	struct rpn *ifrpn; /* 'if' token, or NULL */
+	struct rpn *lastelse; /* chain of 'else' tokens, via rpn->rpn */
+	int pos; /* token position of 'if', for diagnostics */
+};
+
+static inline void rpn_fixup(struct rpn_code *code, int idx, int target)
+{
+	code->insn[idx].jump = target - (idx+1);
+}
+
+static void rpn_fixup_chain(struct rpn_code *code, int idx, int target)
+{
+	int next;
+
+	/* the chain is linked via the (not yet used) jump member */
+	for (; idx >= 0; idx = next) {
+		next = code->insn[idx].jump;
+		rpn_fixup(code, idx, target);
+	}
+}
+
+/* close a block on <fi>, or at the end (fi == NULL) */
+static void rpn_close_block(struct rpn_code *code, struct rpn_block *blk,
+		struct rpn *fi)
+{
+	struct rpn *rpn, *next;
+
+	if (blk->cond >= 0 && !blk->haselse)
+		rpn_fixup(code, blk->cond, code->n);
+	rpn_fixup_chain(code, blk->jumps, code->n);
+
+	/* resolve the list too:
+	 * 'if' continues after the last 'else', each 'else' at 'fi'
+	 */
+	if (blk->ifrpn)
+		blk->ifrpn->rpn = blk->lastelse ? blk->lastelse->next : fi;
+	for (rpn = blk->lastelse; rpn; rpn = next) {
+		next = rpn->rpn;
+		rpn->rpn = fi;
+	}
+}
+
+static struct rpn_code *rpn_compile(struct rpn *root)
+{
+	struct rpn_code *code;
+	struct rpn_insn *insn;
+	struct rpn *rpn;
+	struct rpn_block *blocks = NULL, *blk;
+	int n, nblocks = 0, sblocks = 0, op, pos;
+
+	for (n = 0, rpn = root; rpn; rpn = rpn->next, ++n);
+	code = malloc(sizeof(*code) + n*sizeof(code->insn[0]));
+	if (!code)
+		mylog(LOG_ERR, "malloc failed?");
+	code->n = 0;
+
+	for (pos = 1, rpn = root; rpn; rpn = rpn->next, ++pos) {
+		op = rpn_opcode(rpn);
+		if (op == OP_FI) {
+			/* a 'fi' is only a jump target */
+			if (!nblocks) {
+				mylog(LOG_WARNING, "fi (token %i) without if", pos);
+				continue;
+			}
+			rpn_close_block(code, &blocks[--nblocks], rpn);
+			continue;
+		}
+		insn = &code->insn[code->n];
+		*insn = (struct rpn_insn){
+			.op = op,
+			.value = rpn->value,
+			.rpn = rpn,
+		};
+		if (op == OP_IF || (op == OP_ELSE && !nblocks)) {
+			/* open a block,
+			 * an 'else' without 'if' jumps to the next 'fi'
+			 */
+			if (nblocks >= sblocks) {
+				sblocks += 16;
+				blocks = realloc(blocks, sizeof(*blocks)*sblocks);
+				if (!blocks)
+					mylog(LOG_ERR, "realloc blocks %u failed", sblocks);
 			}
-			--nested;
+			blocks[nblocks++] = (struct rpn_block){
+				.cond = (op == OP_IF) ? code->n : -1,
+				.jumps = -1,
+				.ifrpn = (op == OP_IF) ? rpn : NULL,
+				.pos = pos,
+			};
+			if (op == OP_ELSE)
+				mylog(LOG_WARNING, "else (token %i) without if", pos);
+		}
+		if (op == OP_ELSE) {
+			blk = &blocks[nblocks-1];
+			if (blk->haselse)
+				mylog(LOG_WARNING, "2nd else (token %i) unexpected", pos);
+			/* false condition continues after the last 'else' */
+			if (blk->cond >= 0)
+				rpn_fixup(code, blk->cond, code->n+1);
+			blk->haselse = 1;
+			insn->jump = blk->jumps;
+			blk->jumps = code->n;
+			rpn->rpn = blk->lastelse;
+			blk->lastelse = rpn;
+		}
+		++code->n;
+	}
+	/* blocks without 'fi' jump to the end, i.e. quit */
+	while (nblocks) {
+		blk = &blocks[--nblocks];
+		if (blk->ifrpn)
+			mylog(LOG_WARNING, "if (token %i) without fi", blk->pos);
+		rpn_close_block(code, blk, NULL);
+	}
+	if (blocks)
+		free(blocks);
+	return code;
+}
+
+/* optimizer */
+static const struct opeffect {
+	signed char pop, push; /* stack effect */
+	signed char pure; /* no state, no side effects: fold over constants */
+	signed char nostr; /* leaves no st->strvalue */
+} opeffects[] = {
+	[OP_CALL] = { -1, -1, },
+	[OP_CONST] = { 0, 1, },
+	[OP_STRCONST] = { 0, 1, },
+	[OP_ENV] = { 0, 1, },
+	[OP_WRITEENV] = { 1, 0, 0, 1, },
+
+	[OP_PLUS] = { 2, 1, 1, 1, },
+	[OP_MINUS] = { 2, 1, 1, 1, },
+	[OP_MUL] = { 2, 1, 1, 1, },
+	[OP_DIV] = { 2, 1, 1, 1, },
+	[OP_MOD] = { 2, 1, 1, 1, },
+	[OP_POW] = { 2, 1, 1, 1, },
+	[OP_NEG] = { 1, 1, 1, 1, },
+
+	[OP_BITAND] = { 2, 1, 1, 1, },
+	[OP_BITOR] = { 2, 1, 1, 1, },
+	[OP_BITXOR] = { 2, 1, 1, 1, },
+	[OP_BITINV] = { 1, 1, 1, 1, },
+
+	[OP_BOOLAND] = { 2, 1, 1, 1, },
+	[OP_BOOLOR] = { 2, 1, 1, 1, },
+	[OP_BOOLNOT] = { 1, 1, 1, 1, },
+	[OP_EQ] = { 2, 1, 1, 1, },
+	[OP_NE] = { 2, 1, 1, 1, },
+	[OP_LT] = { 2, 1, 1, 1, },
+	[OP_GT] = { 2, 1, 1, 1, },
+
+	[OP_DUP] = { 1, 2, 1, 1, },
+	[OP_SWAP] = { 2, 2, 1, 1, },
+	[OP_IFTHENELSE] = { 3, 1, 1, 1, },
+
+	[OP_ENVLTC] = { 0, 1, 0, 1, },
+	[OP_ENVGTC] = { 0, 1, 0, 1, },
+	[OP_ENVEQC] = { 0, 1, 0, 1, },
+	[OP_ENVNEC] = { 0, 1, 0, 1, },
+	[OP_ENVENVAND] = { 0, 1, 0, 1, },
+	[OP_ENVENVOR] = { 0, 1, 0, 1, },
+
+	[OP_IF] = { 1, 0, },
+	[OP_ELSE] = { 0, 0, },
+	[OP_QUIT] = { 0, 0, },
+};
+
+static inline int rpn_isconst(const struct rpn_insn *insn)
+{
+	return insn->op == OP_CONST || insn->op == OP_STRCONST;
+}
 
-		} else if (rpn->run == rpn_do_else) {
-			if (!nested)
-				*pelse = rpn;
+/* 1 peephole pass over the code
+ * Instructions are never combined across a jump target.
+ * return the number of changes
+ */
+static int rpn_optimize_pass(struct rpn_code *code)
+{
+	struct rpn_insn *out = code->insn, insn;
+	const struct opeffect *eff;
+	struct stack st;
+	double v[4];
+	char *target;
+	int *map, *depth;
+	int j, k, n = code->n, nout, barrier, dead, changed = 0;
+	/* state at the barrier */
+	int bardepth, barnostr;
+
+	target = calloc(n+1, sizeof(*target));
+	map = malloc((n+1)*sizeof(*map));
+	depth = malloc((n+1)*sizeof(*depth));
+	if (!target || !map || !depth)
+		mylog(LOG_ERR, "malloc failed?");
+
+	/* make jumps absolute, mark the targets */
+	for (j = 0; j < n; ++j) {
+		if (out[j].op == OP_IF || out[j].op == OP_ELSE) {
+			out[j].jump += j+1;
+			target[out[j].jump] = 1;
 		}
 	}
+
+	/* the stack starts empty, without strvalue */
+	nout = barrier = dead = 0;
+	bardepth = 0;
+	barnostr = 1;
+#define DEPTH(idx)	(((idx) > barrier) ? depth[(idx)-1] : bardepth)
+#define NOSTR(idx)	(((idx) > barrier) ? opeffects[out[(idx)-1].op].nostr : barnostr)
+	for (j = 0; j < n; ++j) {
+		map[j] = nout;
+		if (target[j]) {
+			/* more than 1 path leads here */
+			barrier = nout;
+			bardepth = -1;
+			barnostr = 0;
+			dead = 0;
+		} else if (dead) {
+			/* unreachable */
+			++changed;
+			continue;
+		}
+		insn = out[j];
+		eff = &opeffects[insn.op];
+
+		if (eff->pure && nout - eff->pop >= barrier) {
+			/* fold over constant operands */
+			for (k = nout - eff->pop; k < nout; ++k) {
+				if (!rpn_isconst(&out[k]))
+					break;
+			}
+			if (k >= nout) {
+				st = (struct stack){ .v = v, .s = sizeof(v)/sizeof(v[0]), };
+				for (k = nout - eff->pop; k < nout; ++k)
+					st.v[st.n++] = out[k].value;
+				if (insn.rpn->run(&st, insn.rpn) >= 0) {
+					nout -= eff->pop;
+					for (k = 0; k < st.n; ++k, ++nout) {
+						/* the operator's token has no strvalue */
+						out[nout] = (struct rpn_insn){
+							.op = OP_CONST,
+							.value = st.v[k],
+							.rpn = insn.rpn,
+						};
+						depth[nout] = (DEPTH(nout) < 0) ? -1 : DEPTH(nout)+1;
+					}
+					++changed;
+					continue;
+				}
+			}
+		}
+
+		switch (insn.op) {
+		case OP_SWAP:
+			if (nout > barrier && out[nout-1].op == OP_DUP) {
+				/* dup swap: swapping equal values */
+				++changed;
+				continue;
+			}
+			/* fall through */
+		case OP_NEG:
+			/* swap swap, neg neg: removable when they cannot underflow,
+			 * and the strvalue is cleared already
+			 */
+			if (nout > barrier && out[nout-1].op == insn.op &&
+					DEPTH(nout-1) >= eff->pop && NOSTR(nout-1)) {
+				--nout;
+				++changed;
+				continue;
+			}
+			break;
+		case OP_IF:
+			/* constant condition */
+			if (nout > barrier && rpn_isconst(&out[nout-1]) &&
+					!out[nout-1].rpn->strvalue && NOSTR(nout-1)) {
+				--nout;
+				++changed;
+				if (rpn_toint(out[nout].value))
+					continue;
+				/* always false: jump */
+				insn.op = OP_ELSE;
+			}
+			break;
+		case OP_ELSE:
+			if (insn.jump == j+1) {
+				/* jump to the next instruction */
+				++changed;
+				continue;
+			}
+			break;
+		case OP_LT:
+		case OP_GT:
+		case OP_EQ:
+		case OP_NE:
+			/* fuse ${topic} CONST <compare> */
+			if (nout-2 >= barrier && out[nout-2].op == OP_ENV && rpn_isconst(&out[nout-1])) {
+				insn.value = out[nout-1].value;
+				insn.rpn = out[nout-2].rpn;
+				insn.op = (insn.op == OP_LT) ? OP_ENVLTC :
+					(insn.op == OP_GT) ? OP_ENVGTC :
+					(insn.op == OP_EQ) ? OP_ENVEQC : OP_ENVNEC;
+				nout -= 2;
+				++changed;
+			}
+			break;
+		case OP_BOOLAND:
+		case OP_BOOLOR:
+			/* fuse ${topic} ${topic2} <and/or> */
+			if (nout-2 >= barrier && out[nout-2].op == OP_ENV && out[nout-1].op == OP_ENV) {
+				insn.rpn2 = out[nout-1].rpn;
+				insn.rpn = out[nout-2].rpn;
+				insn.op = (insn.op == OP_BOOLAND) ? OP_ENVENVAND : OP_ENVENVOR;
+				nout -= 2;
+				++changed;
+			}
+			break;
+		}
+
+		/* emit */
+		eff = &opeffects[insn.op];
+		k = DEPTH(nout);
+		depth[nout] = (k < 0 || eff->pop < 0 || k < eff->pop) ? -1 : k - eff->pop + eff->push;
+		out[nout++] = insn;
+		if (insn.op == OP_ELSE || insn.op == OP_QUIT)
+			/* code up to the next jump target is dead */
+			dead = 1;
+	}
+#undef DEPTH
+#undef NOSTR
+	map[n] = nout;
+	code->n = nout;
+
+	/* relative jumps again */
+	for (j = 0; j < nout; ++j) {
+		if (out[j].op == OP_IF || out[j].op == OP_ELSE)
+			out[j].jump = map[out[j].jump] - (j+1);
+	}
+	free(target);
+	free(map);
+	free(depth);
+	return changed;
+}
+
+static void rpn_optimize(struct rpn_code *code)
+{
+	while (rpn_optimize_pass(code));
 }
 
-static void rpn_test_if(struct rpn *me)
+/* verifier */
+static void rpn_insn_effect(const struct rpn_insn *insn, int *ppop, int *ppush)
 {
-	struct rpn *pelse, *pfi;
+	const struct lookup *lookup;
 
-	rpn_find_fi_else(me, &pelse, &pfi);
-	if (!pfi)
-		mylog(LOG_WARNING, "if without fi");
-	me->rpn = pelse ? pelse->next : pfi;
+	if (insn->op != OP_CALL) {
+		*ppop = opeffects[insn->op].pop;
+		*ppush = opeffects[insn->op].push;
+		return;
+	}
+	lookup = do_lookup_run(insn->rpn->run);
+	*ppop = lookup ? lookup->pop : 0;
+	*ppush = lookup ? lookup->push : 0;
 }
 
-static void rpn_test_else(struct rpn *me)
+/* describe a token for diagnostics, in <buf> */
+static const char *rpn_token_str(const struct rpn *rpn, char *buf, int size)
 {
-	struct rpn *pelse, *pfi;
+	const struct lookup *lookup;
+	char numbuf[64];
 
-	rpn_find_fi_else(me, &pelse, &pfi);
-	if (pelse)
-		mylog(LOG_WARNING, "2nd else unexpected");
-	me->rpn = pfi;
+	if (rpn->topic)
+		snprintf(buf, size, "%c{%s}", (rpn->run == rpn_do_env) ? '$' :
+				rpn->cookie ? '=' : '>', rpn->topic);
+	else if (rpn->run == rpn_do_const || rpn->run == rpn_do_strconst)
+		snprintf(buf, size, "%s", rpn->strvalue ?: mydtostr_r(rpn->value, numbuf, sizeof(numbuf)));
+	else {
+		lookup = do_lookup_run(rpn->run);
+		snprintf(buf, size, "%s", lookup ? lookup->str : "");
+	}
+	return buf;
 }
 
-static int rpn_do_quit(struct stack *st, struct rpn *me)
+const char *rpn_token_class(const struct rpn *rpn)
 {
-	st->jumpto = QUIT;
-	/* real quit is done in rpn_run */
-	st->strvalueset = 1;
-	return 0;
+	const struct lookup *lookup;
+
+	if (rpn->run == rpn_do_env)
+		return "${}";
+	else if (rpn->run == rpn_do_writeenv)
+		return rpn->cookie ? "={}" : ">{}";
+	else if (rpn->run == rpn_do_strconst)
+		return "\"\"";
+	else if (rpn->run == rpn_do_const)
+		return "N";
+	lookup = do_lookup_run(rpn->run);
+	return lookup ? lookup->str : "?";
+}
+
+/* prove that no path through <code> underflows the stack,
+ * which starts empty.
+ * The depth at each instruction is an interval [lo, hi],
+ * over all if/else paths. Jumps go forward only,
+ * so 1 pass in order sees all paths into an instruction first.
+ */
+static int rpn_verify(struct rpn *root, struct rpn_code *code)
+{
+	int *lo, *hi;
+	int j, pop, push, target, pos, ret = 0;
+	struct rpn *rpn;
+	char tokbuf[128];
+
+	lo = malloc((code->n+1)*sizeof(*lo));
+	hi = malloc((code->n+1)*sizeof(*hi));
+	if (!lo || !hi)
+		mylog(LOG_ERR, "malloc failed?");
+	for (j = 0; j <= code->n; ++j) {
+		/* not reached yet */
+		lo[j] = INT_MAX;
+		hi[j] = -1;
+	}
+	lo[0] = hi[0] = 0;
+	code->maxdepth = 0;
+
+#define MERGE(idx, l, h) \
+	do { \
+		if ((l) < lo[idx]) \
+			lo[idx] = (l); \
+		if ((h) > hi[idx]) \
+			hi[idx] = (h); \
+	} while (0)
+	for (j = 0; j < code->n; ++j) {
+		if (hi[j] < 0)
+			/* unreachable */
+			continue;
+		if (hi[j] > code->maxdepth)
+			code->maxdepth = hi[j];
+		rpn_insn_effect(&code->insn[j], &pop, &push);
+		if (lo[j] < pop) {
+			for (pos = 1, rpn = root; rpn && rpn != code->insn[j].rpn; rpn = rpn->next, ++pos);
+			mylog(LOG_WARNING, "stack underflow at '%s' (token %i): needs %i, has %s%i",
+					rpn_token_str(code->insn[j].rpn, tokbuf, sizeof(tokbuf)), pos, pop,
+					(lo[j] != hi[j]) ? "as few as " : "", lo[j]);
+			ret = -1;
+			break;
+		}
+		if (code->insn[j].op == OP_IF || code->insn[j].op == OP_ELSE) {
+			target = j+1+code->insn[j].jump;
+			MERGE(target, lo[j]-pop, hi[j]-pop);
+		}
+		if (code->insn[j].op != OP_ELSE && code->insn[j].op != OP_QUIT)
+			MERGE(j+1, lo[j]-pop+push, hi[j]-pop+push);
+	}
+#undef MERGE
+	if (hi[code->n] > code->maxdepth)
+		code->maxdepth = hi[code->n];
+	free(lo);
+	free(hi);
+	return ret;
 }
 
 /* run time functions */
@@ -788,10 +1494,184 @@ void rpn_stack_reset(struct stack *st)
 	st->jumpto = NULL;
 }
 
+/* run verified code: no underflow checks, the stack is sized once */
+static int rpn_exec(struct stack *st, const struct rpn_code *code)
+{
+	const struct rpn_insn *insn;
+	double tmp, tmp2;
+	int ip, ret;
+
+	if (st->n + code->maxdepth > st->s) {
+		st->s = st->n + code->maxdepth;
+		st->v = realloc(st->v, st->s * sizeof(st->v[0]));
+		if (!st->v)
+			mylog(LOG_ERR, "realloc stack %u failed", st->s);
+	}
+	for (ip = 0; ip < code->n;) {
+		insn = &code->insn[ip++];
+		switch (insn->op) {
+		case OP_CONST:
+		case OP_STRCONST:
+			rpn_set_strvalue(st, insn->rpn->strvalue);
+			rpn_push_fast(st, insn->value);
+			continue;
+		case OP_ENV:
+			rpn_set_strvalue(st, rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp));
+			rpn_push_fast(st, tmp);
+			continue;
+		case OP_WRITEENV:
+			rpn_write_env(st->strvalue ?: mydtostr(st->v[st->n-1]), insn->rpn->topic, insn->rpn);
+			st->n -= 1;
+			break;
+
+		case OP_PLUS:
+			st->v[st->n-2] = st->v[st->n-2] + st->v[st->n-1];
+			st->n -= 1;
+			break;
+		case OP_MINUS:
+			st->v[st->n-2] = st->v[st->n-2] - st->v[st->n-1];
+			st->n -= 1;
+			break;
+		case OP_MUL:
+			st->v[st->n-2] = st->v[st->n-2] * st->v[st->n-1];
+			st->n -= 1;
+			break;
+		case OP_DIV:
+			st->v[st->n-2] = st->v[st->n-2] / st->v[st->n-1];
+			st->n -= 1;
+			break;
+		case OP_MOD:
+			st->v[st->n-2] = fmod(st->v[st->n-2], st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_POW:
+			st->v[st->n-2] = pow(st->v[st->n-2], st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_NEG:
+			st->v[st->n-1] = -st->v[st->n-1];
+			break;
+
+		case OP_BITAND:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) & rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_BITOR:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) | rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_BITXOR:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) ^ rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_BITINV:
+			st->v[st->n-1] = ~rpn_toint(st->v[st->n-1]);
+			break;
+
+		case OP_BOOLAND:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) && rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_BOOLOR:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) || rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_BOOLNOT:
+			st->v[st->n-1] = !rpn_toint(st->v[st->n-1]);
+			break;
+		case OP_EQ:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) == rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_NE:
+			st->v[st->n-2] = rpn_toint(st->v[st->n-2]) != rpn_toint(st->v[st->n-1]);
+			st->n -= 1;
+			break;
+		case OP_LT:
+			st->v[st->n-2] = st->v[st->n-2] < st->v[st->n-1];
+			st->n -= 1;
+			break;
+		case OP_GT:
+			st->v[st->n-2] = st->v[st->n-2] > st->v[st->n-1];
+			st->n -= 1;
+			break;
+
+		case OP_DUP:
+			rpn_push_fast(st, st->v[st->n-1]);
+			break;
+		case OP_SWAP:
+			tmp = st->v[st->n-2];
+			st->v[st->n-2] = st->v[st->n-1];
+			st->v[st->n-1] = tmp;
+			break;
+		case OP_IFTHENELSE:
+			st->v[st->n-3] = rpn_toint(st->v[st->n-3]) ? st->v[st->n-2] : st->v[st->n-1];
+			st->n -= 2;
+			break;
+
+		case OP_ENVLTC:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_push_fast(st, tmp < insn->value);
+			break;
+		case OP_ENVGTC:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_push_fast(st, tmp > insn->value);
+			break;
+		case OP_ENVEQC:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_push_fast(st, rpn_toint(tmp) == rpn_toint(insn->value));
+			break;
+		case OP_ENVNEC:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_push_fast(st, rpn_toint(tmp) != rpn_toint(insn->value));
+			break;
+		case OP_ENVENVAND:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_lookup_env(insn->rpn2->topic, insn->rpn2, &tmp2);
+			rpn_push_fast(st, rpn_toint(tmp) && rpn_toint(tmp2));
+			break;
+		case OP_ENVENVOR:
+			rpn_lookup_env(insn->rpn->topic, insn->rpn, &tmp);
+			rpn_lookup_env(insn->rpn2->topic, insn->rpn2, &tmp2);
+			rpn_push_fast(st, rpn_toint(tmp) || rpn_toint(tmp2));
+			break;
+
+		/* flow control keeps st->strvalue */
+		case OP_IF:
+			st->n -= 1;
+			if (!rpn_toint(st->v[st->n]))
+				ip += insn->jump;
+			continue;
+		case OP_ELSE:
+			ip += insn->jump;
+			continue;
+		case OP_QUIT:
+			return 0;
+
+		default:
+			st->jumpto = NULL;
+			st->strvalueset = 0;
+			ret = insn->rpn->run(st, insn->rpn);
+			if (!st->strvalueset)
+				st->strvalue = NULL;
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		/* keep st->strvalue valid only 1 instruction */
+		st->strvalue = NULL;
+	}
+	return 0;
+}
+
 int rpn_run(struct stack *st, struct rpn *rpn)
 {
 	int ret;
 
+	if (rpn && rpn->code)
+		return rpn_exec(st, rpn->code);
+
+	/* not compiled, walk the list */
 	for (; rpn; rpn = st->jumpto ?: rpn->next) {
 		if (rpn == QUIT)
 			break;
@@ -807,168 +1687,82 @@ int rpn_run(struct stack *st, struct rpn *rpn)
 	return 0;
 }
 
-/* parser */
-static struct lookup {
-	const char *str;
-	int (*run)(struct stack *, struct rpn *);
-} const lookups[] = {
-	{ "+", rpn_do_plus, },
-	{ "-", rpn_do_minus, },
-	{ "*", rpn_do_mul, },
-	{ "/", rpn_do_div, },
-	{ "%", rpn_do_mod, },
-	{ "**", rpn_do_pow, },
-	{ "neg", rpn_do_negative, },
-
-	{ "&", rpn_do_bitand, },
-	{ "|", rpn_do_bitor, },
-	{ "^", rpn_do_bitxor, },
-	{ "~", rpn_do_bitinv, },
-
-	{ "&&", rpn_do_booland, },
-	{ "||", rpn_do_boolor, },
-	{ "!", rpn_do_boolnot, },
-	{ "not", rpn_do_boolnot, },
-	{ "==", rpn_do_intequal, },
-	{ "!=", rpn_do_intnotequal, },
-
-	{ "<", rpn_do_lt, },
-	{ ">", rpn_do_gt, },
-
-	{ "dup", rpn_do_dup, },
-	{ "swap", rpn_do_swap, },
-	{ "?:", rpn_do_ifthenelse, },
-
-	{ "limit", rpn_do_limit, },
-	{ "inrange", rpn_do_inrange, },
-	{ "category", rpn_do_category, },
-	{ "hyst1", rpn_do_hyst1, },
-	{ "hyst2", rpn_do_hyst2, },
-	{ "hyst", rpn_do_hyst2, },
-
-	{ "ondelay", rpn_do_ondelay, },
-	{ "offdelay", rpn_do_offdelay, },
-	{ "afterdelay", rpn_do_afterdelay, },
-	{ "debounce", rpn_do_debounce, },
-	{ "autoreset", rpn_do_autoreset, },
-
-	{ "isnew", rpn_do_isnew, },
-	{ "edge", rpn_do_edge, },
-	{ "rising", rpn_do_rising, },
-	{ "falling", rpn_do_falling, },
-	{ "changed", rpn_do_edge, },
-	{ "pushed", rpn_do_rising, },
-
-	{ "wakeup", rpn_do_wakeup, },
-	{ "timeofday", rpn_do_timeofday, },
-	{ "dayofweek", rpn_do_dayofweek, },
-	{ "abstime", rpn_do_abstime, },
-	{ "uptime", rpn_do_uptime, },
-	{ "strftime", rpn_do_strftime, },
-
-	{ "sun", rpn_do_sun, },
-
-	{ "if", rpn_do_if, },
-	{ "else", rpn_do_else, },
-	{ "fi", rpn_do_fi, },
-	{ "quit", rpn_do_quit, },
-	{ "", },
-};
-
-static const struct lookup *do_lookup(const char *tok)
-{
-	const struct lookup *lookup;
-
-	for (lookup = lookups; lookup->str[0]; ++lookup) {
-		if (!strcmp(lookup->str, tok))
-			return lookup;
-	}
-	return NULL;
-}
-
-static struct constant {
-	const char *name;
-	double value;
-} const constants[] = {
-	{ "pi", M_PI, },
-	{ "e", M_E, },
-	{ "", NAN, },
-};
-
-static const struct constant *do_constant(const char *tok)
+/* tokenizer: return the next token of *pstr, with its length in *plen,
+ * or NULL at the end.
+ * Don't seperate between " chars, the " chars remain in the token.
+ * The input is not modified, so this is reentrant.
+ */
+static const char *rpn_next_token(const char **pstr, int *plen)
 {
-	const struct constant *lp;
+	const char *str, *tok;
+	int instring = 0;
 
-	for (lp = constants; *lp->name; ++lp) {
-		if (!strcmp(lp->name, tok))
-			return lp;
+	str = *pstr + strspn(*pstr, " \t");
+	if (!*str)
+		return NULL;
+	for (tok = str; *str; ++str) {
+		if (!instring && (*str == ' ' || *str == '\t'))
+			break;
+		if (*str == '"')
+			instring = !instring;
 	}
-	return NULL;
+	*plen = str - tok;
+	*pstr = str;
+	return tok;
 }
 
-/* modified strtok:
- * don't seperate between " chars
- * This keeps the " characters in the string.
- */
-static char *mystrtok(char *newstr, const char *sep)
+/* mystrtod for a token that is not null terminated */
+static double token_strtod(const char *tok, int len)
 {
-	static char *str;
-	char *savedstr = NULL;
-	int instring = 0;
+	char buf[64], *str;
+	double value;
 
-	if (newstr)
-		str = newstr;
-	for (; *str; ++str) {
-		if (!instring && strchr(sep, *str)) {
-			if (savedstr) {
-				/* end reached */
-				*str++ = 0;
-				return savedstr;
-			} else {
-				/* start ok token */
-				savedstr = str;
-			}
-		} else {
-			if (!savedstr)
-				savedstr = str;
-			if (*str == '"')
-				instring = !instring;
-		}
+	if (len < sizeof(buf)) {
+		memcpy(buf, tok, len);
+		buf[len] = 0;
+		return mystrtod(buf, NULL);
 	}
-	return savedstr;
+	str = strndup(tok, len);
+	value = mystrtod(str, NULL);
+	free(str);
+	return value;
 }
 
 static const char digits[] = "0123456789";
 int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 {
-	char *savedstr;
-	char *tok;
-	int result;
+	const char *tok;
+	int result, len;
 	struct rpn *last = NULL, *rpn, **localproot;
-	const struct lookup *lookup;
-	const struct constant *constant;
+	const struct namehash *ent;
 
+	/* the compiled form becomes stale */
+	if (*proot && (*proot)->code) {
+		free((*proot)->code);
+		(*proot)->code = NULL;
+	}
 	/* find current 'last' rpn */
 	for (last = *proot; last && last->next; last = last->next);
 	localproot = last ? &last->next : proot;
 	/* parse */
-	savedstr = strdup(cstr);
-	for (tok = mystrtok(savedstr, " \t"), result = 0; tok;
-			tok = mystrtok(NULL, " \t"), ++result) {
+	for (result = 0; (tok = rpn_next_token(&cstr, &len)) != NULL; ++result) {
 		rpn = rpn_create();
-		if (strchr(digits, *tok) || (tok[1] && strchr("+-", *tok) && strchr(digits, tok[1]))) {
+		if (strchr(digits, *tok) || (len > 1 && strchr("+-", *tok) && strchr(digits, tok[1]))) {
 			rpn->run = rpn_do_const;
-			rpn->value = mystrtod(tok, NULL);
+			rpn->value = token_strtod(tok, len);
 
 		} else if (*tok == '"') {
-			if (tok[strlen(tok)-1] == '"')
-				tok[strlen(tok)-1] = 0;
+			/* strip the quotes */
 			++tok;
+			--len;
+			if (len && tok[len-1] == '"')
+				--len;
 			rpn->run = rpn_do_strconst;
-			rpn->strvalue = strdup(tok);
+			rpn->strvalue = strndup(tok, len);
+			rpn->value = mystrtod(rpn->strvalue, NULL);
 
-		} else if (strchr("$>=", *tok) && tok[1] == '{' && tok[strlen(tok)-1] == '}') {
-			rpn->topic = strndup(tok+2, strlen(tok+2)-1);
+		} else if (strchr("$>=", *tok) && tok[1] == '{' && tok[len-1] == '}') {
+			rpn->topic = strndup(tok+2, len-3);
 			switch (*tok) {
 			case '$':
 				rpn->run = rpn_do_env;
@@ -981,16 +1775,16 @@ int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 				rpn->run = rpn_do_writeenv;
 				break;
 			}
-		} else if ((lookup = do_lookup(tok)) != NULL) {
-			rpn->run = lookup->run;
+		} else if ((ent = do_lookup(tok, len)) != NULL && ent->lookup) {
+			rpn->run = ent->lookup->run;
 
-		} else if ((constant = do_constant(tok)) != NULL) {
+		} else if (ent) {
 			rpn->run = rpn_do_const;
-			rpn->value = constant->value;
-			rpn->strvalue = strdup(tok);
+			rpn->value = ent->constant->value;
+			rpn->strvalue = strdup(ent->name);
 
 		} else {
-			mylog(LOG_INFO, "unknown token '%s'", tok);
+			mylog(LOG_INFO, "unknown token '%.*s'", len, tok);
 			rpn_free(rpn);
 			goto failed;
 		}
@@ -1001,7 +1795,6 @@ int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat)
 			*proot = rpn;
 		last = rpn;
 	}
-	free(savedstr);
 	return result;
 
 failed:
@@ -1010,17 +1803,20 @@ failed:
 	return -1;
 }
 
-void rpn_parse_done(struct rpn *root)
+int rpn_parse_done(struct rpn *root)
 {
-	struct rpn *rpn;
-
-	/* do static tests */
-	for (rpn = root; rpn; rpn = rpn->next) {
-		if (rpn->run == rpn_do_if)
-			rpn_test_if(rpn);
-		else if (rpn->run == rpn_do_else)
-			rpn_test_else(rpn);
+	if (!root)
+		return 0;
+	if (root->code)
+		free(root->code);
+	root->code = rpn_compile(root);
+	rpn_optimize(root->code);
+	if (rpn_verify(root, root->code) < 0) {
+		free(root->code);
+		root->code = NULL;
+		return -1;
 	}
+	return 0;
 }
 
 struct rpn *rpn_parse(const char *cstr, void *dat)
@@ -1028,6 +1824,9 @@ struct rpn *rpn_parse(const char *cstr, void *dat)
 	struct rpn *rpns = NULL;
 
 	rpn_parse_append(cstr, &rpns, dat);
-	rpn_parse_done(rpns);
+	if (rpn_parse_done(rpns) < 0) {
+		rpn_free_chain(rpns);
+		return NULL;
+	}
 	return rpns;
 }
@@ -15,20 +15,30 @@ struct rpn {
 	int (*run)(struct stack *st, struct rpn *me);
 	void *dat;
 	char *topic;
+	void *env; /* application's handle for @topic */
 	double value;
 	char *strvalue;
 	int cookie;
 	struct rpn *rpn; /* cached rpn for flow control */
 	void (*timeout)(void *dat); /* scheduled timeout,
 				       usefull to free resources */
+	struct rpn_code *code; /* compiled form, on the first element only */
 };
 
 /* functions */
 int rpn_parse_append(const char *cstr, struct rpn **proot, void *dat);
-void rpn_parse_done(struct rpn *root);
+/* compile, and verify that the stack cannot underflow
+ * return -1 when rejected
+ */
+int rpn_parse_done(struct rpn *root);
 
 struct rpn *rpn_parse(const char *cstr, void *dat);
 
+/* the kind of token, for statistics:
+ * ${} for a topic, N for a number, "" for a string, or the operator
+ */
+const char *rpn_token_class(const struct rpn *rpn);
+
 void rpn_stack_reset(struct stack *st);
 int rpn_run(struct stack *st, struct rpn *rpn);
 
@@ -36,7 +46,8 @@ void rpn_free_chain(struct rpn *rpn);
 void rpn_rebase(struct rpn *first, struct rpn **newptr);
 
 /* imported function */
-extern const char *rpn_lookup_env(const char *str, struct rpn *);
+/* return the string value of topic @str, and its numeric value in @pvalue */
+extern const char *rpn_lookup_env(const char *str, struct rpn *, double *pvalue);
 extern int rpn_write_env(const char *value, const char *str, struct rpn *);
 extern int rpn_env_isnew(void);
 extern void rpn_run_again(void *dat); /* dat is the calling rpn * */
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <locale.h>
@@ -10,9 +11,12 @@
 #include "rpnlogic.h"
 #include "common.h"
 
-const char *rpn_lookup_env(const char *str, struct rpn *rpn)
+const char *rpn_lookup_env(const char *str, struct rpn *rpn, double *pvalue)
 {
-	return getenv(str);
+	const char *value = getenv(str);
+
+	*pvalue = mystrtod(value, NULL);
+	return value;
 }
 int rpn_write_env(const char *value, const char *str, struct rpn *rpn)
 {
@@ -24,11 +28,16 @@ int rpn_env_isnew(void)
 	return 0;
 }
 
+/* simulated time, on a virtual clock */
+static double simtime = -1;
+
 static void my_rpn_run(struct rpn *rpn)
 {
 	struct stack rpnstack = {};
 	int j;
 
+	if (simtime >= 0)
+		printf("@%s ", mydtostr(libt_now()));
 	if (rpn_run(&rpnstack, rpn))
 		printf("failed\n");
 	for (j = 0; j < rpnstack.n; ++j) {
@@ -49,21 +58,146 @@ void rpn_run_again(void *dat)
 	my_rpn_run(*rootrpn);
 }
 
+/* statistics: count token sequences of 2 and 3 in scripts on stdin */
+static int cmpstr(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+struct seqcount {
+	const char *seq;
+	int cnt;
+};
+
+static int cmpcount(const void *a, const void *b)
+{
+	const struct seqcount *sa = a, *sb = b;
+
+	return (sb->cnt - sa->cnt) ?: strcmp(sa->seq, sb->seq);
+}
+
+static int seq_stats(int ntop)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	struct rpn *root, *rpn, *rpn2;
+	char **seqs = NULL;
+	int nseqs = 0, sseqs = 0, nscripts = 0, len, j, k;
+	struct seqcount *counts;
+	int ncounts = 0;
+
+	while (getline(&line, &linesize, stdin) > 0) {
+		line[strcspn(line, "\r\n")] = 0;
+		root = NULL;
+		if (rpn_parse_append(line, &root, NULL) <= 0)
+			continue;
+		++nscripts;
+		for (rpn = root; rpn; rpn = rpn->next) {
+			for (len = 2; len <= 3; ++len) {
+				char buf[128] = "";
+
+				for (j = 0, rpn2 = rpn; j < len && rpn2; ++j, rpn2 = rpn2->next)
+					sprintf(buf+strlen(buf), "%s%s", j ? " " : "", rpn_token_class(rpn2));
+				if (j < len)
+					break;
+				if (nseqs >= sseqs) {
+					sseqs += 1024;
+					seqs = realloc(seqs, sseqs*sizeof(*seqs));
+					if (!seqs)
+						return 1;
+				}
+				seqs[nseqs++] = strdup(buf);
+			}
+		}
+		rpn_free_chain(root);
+	}
+	free(line);
+
+	/* count equal sequences */
+	qsort(seqs, nseqs, sizeof(*seqs), cmpstr);
+	counts = malloc((nseqs ?: 1)*sizeof(*counts));
+	if (!counts)
+		return 1;
+	for (j = 0; j < nseqs; j = k) {
+		for (k = j+1; k < nseqs && !strcmp(seqs[j], seqs[k]); ++k);
+		counts[ncounts++] = (struct seqcount){ .seq = seqs[j], .cnt = k-j, };
+	}
+	qsort(counts, ncounts, sizeof(*counts), cmpcount);
+
+	printf("%i scripts, %i sequences\n", nscripts, nseqs);
+	for (j = 0; j < ncounts && j < ntop; ++j)
+		printf("%7i %s\n", counts[j].cnt, counts[j].seq);
+	for (j = 0; j < nseqs; ++j)
+		free(seqs[j]);
+	free(seqs);
+	free(counts);
+	return 0;
+}
+
+/* parse benchmark: synthetic scripts with <n> nested and <n> sequential if/else blocks */
+static int parse_bench(int n)
+{
+	char *script, *str;
+	struct rpn *rpn;
+	struct timespec t0, t1;
+	int j, ntok;
+
+	script = str = malloc(n*64 + 16);
+	if (!script)
+		return 1;
+	for (j = 0; j < n; ++j)
+		str += sprintf(str, "${a} if ");
+	str += sprintf(str, "1 ");
+	for (j = 0; j < n; ++j)
+		str += sprintf(str, "else %i fi ", j);
+	for (j = 0; j < n; ++j)
+		str += sprintf(str, "${b} %i < if 1 else 0 fi + ", j);
+	ntok = 0;
+	for (str = script; *str; ++str)
+		ntok += *str == ' ';
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	rpn = rpn_parse(script, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("%i tokens, parsed in %.3lf ms\n", ntok,
+			(t1.tv_sec - t0.tv_sec)*1e3 + (t1.tv_nsec - t0.tv_nsec)*1e-6);
+	rpn_free_chain(rpn);
+	free(script);
+	return !rpn;
+}
+
 int main(int argc, char *argv[])
 {
 	struct rpn *rpn = NULL;
 
 	setlocale(LC_TIME, "");
 
-	for (++argv; *argv; ++argv) {
+	++argv;
+	if (*argv && !strcmp(*argv, "-P") && argv[1])
+		/* -P N: parse time of a large synthetic script */
+		return parse_bench(strtoul(argv[1], NULL, 0));
+	if (*argv && !strcmp(*argv, "-S"))
+		/* -S [TOP]: statistics of scripts on stdin, 1 per line */
+		return seq_stats(argv[1] ? strtoul(argv[1], NULL, 0) : 20);
+	if (*argv && !strcmp(*argv, "-t") && argv[1]) {
+		/* -t SECONDS: run the timers for SECONDS on a virtual clock */
+		simtime = mystrtod(argv[1], NULL);
+		libt_virtual_clock(0);
+		argv += 2;
+	}
+	for (; *argv; ++argv) {
 		if (rpn_parse_append(*argv, &rpn, &rpn) < 0)
 			return 1;
 	}
-	rpn_parse_done(rpn);
-	if (!rpn)
+	if (rpn_parse_done(rpn) < 0 || !rpn)
 		return 1;
 
 	my_rpn_run(rpn);
+	if (simtime >= 0) {
+		while (libt_idle() >= 0 && libt_now() <= simtime)
+			libt_flush();
+		return 0;
+	}
 	for (; libt_get_waittime() >= 0;) {
 		libt_flush();
 		sleep(1);
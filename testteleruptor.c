@@ -18,6 +18,7 @@
 
 #include "lib/libt.h"
 #include "common.h"
+#include "evloop.h"
 
 #define NAME "testteleruptor"
 #ifndef VERSION
@@ -40,6 +41,7 @@ static const char help_msg[] =
 	" -v, --verbose		Be more verbose\n"
 	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
 	" -w, --write=STR	Give MQTT topic suffix for writing the topic (default /set)\n"
+	" -z, --virtual		Run on the shared virtual clock of mqttvclock, for simulations\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -50,6 +52,7 @@ static struct option long_opts[] = {
 
 	{ "mqtt", required_argument, NULL, 'm', },
 	{ "write", required_argument, NULL, 'w', },
+	{ "virtual", no_argument, NULL, 'z', },
 
 	{ },
 };
@@ -57,7 +60,7 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:w:";
+static const char optstring[] = "Vv?m:w:z";
 
 /* logging */
 static int loglevel = LOG_WARNING;
@@ -109,6 +112,8 @@ static void pulselo(void *dat)
 
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
 {
+	if (evloop_clock_msg(msg))
+		return;
 	if (!strcmp(msg->topic, topic_ctl_set ?: topic_ctl)) {
 		int newvalue;
 
@@ -153,7 +158,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret;
 	char *str;
 	char mqtt_name[32];
 
@@ -167,6 +172,9 @@ int main(int argc, char *argv[])
 	case 'v':
 		++loglevel;
 		break;
+	case 'z':
+		evloop_virtual_clock();
+		break;
 	case 'm':
 		mqtt_host = optarg;
 		str = strrchr(optarg, ':');
@@ -218,14 +226,9 @@ int main(int argc, char *argv[])
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_subscribe '%s': %s", topic_ctl_set ?: topic_ctl, mosquitto_strerror(ret));
 
+	evloop_init(mosq, mqtt_keepalive);
 	while (1) {
-		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		evloop_iterate(-1);
 	}
 	return 0;
 }